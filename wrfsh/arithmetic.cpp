@@ -0,0 +1,414 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <climits>
+#include <cctype>
+#include <cstring>
+
+#include "common.h"
+#include "global_state.h"
+#include "arithmetic.h"
+
+using namespace std;
+
+namespace
+{
+    const int unary_level = 10;
+
+    bool is_name_start(char c)
+    {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+    }
+
+    bool is_digit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    bool is_alnum(char c)
+    {
+        return is_name_start(c) || is_digit(c);
+    }
+
+    // Overflow wraps around instead of being undefined.
+    long long wrap(unsigned long long x)
+    {
+        return static_cast<long long>(x);
+    }
+}
+
+arithmetic::arithmetic(const string& text) :
+    m_nodes(),
+    m_root(-1),
+    m_error(),
+    m_text(&text),
+    m_pos(0)
+{
+    m_root = parse_binary(0);
+    skip_space();
+
+    if (m_error.empty() && m_pos != text.size())
+    {
+        m_error = "unexpected \"" + text.substr(m_pos) + "\"";
+    }
+
+    m_text = nullptr;
+}
+
+size_t arithmetic::find_end(const string& text, size_t start)
+{
+    int depth = 0;
+    for (size_t i = start; i < text.size(); i++)
+    {
+        if (text[i] == '(')
+        {
+            depth++;
+        }
+        else if (text[i] == ')')
+        {
+            if (depth > 0)
+            {
+                depth--;
+            }
+            else
+            {
+                return (i + 1 < text.size() && text[i + 1] == ')') ? i : string::npos;
+            }
+        }
+    }
+    return string::npos;
+}
+
+bool arithmetic::is_constant(long long& value) const
+{
+    if (m_error.empty() && m_nodes[m_root].type == op::constant)
+    {
+        value = m_nodes[m_root].value;
+        return true;
+    }
+    return false;
+}
+
+long long arithmetic::evaluate(global_state& state, ostream& err) const
+{
+    if (!m_error.empty())
+    {
+        err << "Syntax error in arithmetic: " << m_error << "\n";
+        state.error = true;
+        return 0;
+    }
+
+    return evaluate(m_root, state, err);
+}
+
+long long arithmetic::evaluate(int index, global_state& state, ostream& err) const
+{
+    const node& n = m_nodes[index];
+    switch (n.type)
+    {
+    case op::constant:
+        return n.value;
+
+    case op::variable:
+        return state.lookup_number(static_cast<size_t>(n.value));
+
+    case op::logical_and:
+        return evaluate(n.left, state, err) != 0 && evaluate(n.right, state, err) != 0;
+
+    case op::logical_or:
+        return evaluate(n.left, state, err) != 0 || evaluate(n.right, state, err) != 0;
+
+    default:
+        break;
+    }
+
+    long long a = evaluate(n.left, state, err);
+    long long b = (n.right < 0) ? 0 : evaluate(n.right, state, err);
+    long long result;
+    if (!apply(n.type, a, b, result))
+    {
+        err << "Error: division by zero\n";
+        state.error = true;
+        return 0;
+    }
+    return result;
+}
+
+// Work out one operation. Returns false for division by zero.
+bool arithmetic::apply(op type, long long a, long long b, long long& result)
+{
+    const unsigned long long ua = static_cast<unsigned long long>(a);
+    const unsigned long long ub = static_cast<unsigned long long>(b);
+
+    switch (type)
+    {
+    case op::negate:        result = wrap(0 - ua); break;
+    case op::logical_not:   result = !a; break;
+    case op::complement:    result = ~a; break;
+    case op::multiply:      result = wrap(ua * ub); break;
+    case op::divide:
+    case op::modulo:
+        if (b == 0)
+        {
+            return false;
+        }
+        else if (a == LLONG_MIN && b == -1)
+        {
+            result = (type == op::divide) ? a : 0;
+        }
+        else
+        {
+            result = (type == op::divide) ? a / b : a % b;
+        }
+        break;
+    case op::add:           result = wrap(ua + ub); break;
+    case op::subtract:      result = wrap(ua - ub); break;
+    case op::shift_left:    result = wrap(ua << (b & 63)); break;
+    case op::shift_right:   result = a >> (b & 63); break;
+    case op::less:          result = a < b; break;
+    case op::less_equal:    result = a <= b; break;
+    case op::greater:       result = a > b; break;
+    case op::greater_equal: result = a >= b; break;
+    case op::equal:         result = a == b; break;
+    case op::not_equal:     result = a != b; break;
+    case op::bit_and:       result = a & b; break;
+    case op::bit_xor:       result = a ^ b; break;
+    case op::bit_or:        result = a | b; break;
+    case op::logical_and:   result = a && b; break;
+    case op::logical_or:    result = a || b; break;
+    default:                result = 0; break;
+    }
+    return true;
+}
+
+// Add a node, or if its operands are constants, the constant it works out to.
+int arithmetic::add_node(op type, long long value, int left, int right)
+{
+    if (type != op::constant && type != op::variable
+        && m_nodes[left].type == op::constant
+        && (right < 0 || m_nodes[right].type == op::constant))
+    {
+        long long result;
+        if (apply(type, m_nodes[left].value, (right < 0) ? 0 : m_nodes[right].value, result))
+        {
+            // The operands aren't used by anything else; reuse the left one's node.
+            if (right == static_cast<int>(m_nodes.size()) - 1)
+            {
+                m_nodes.pop_back();
+            }
+            m_nodes[left].value = result;
+            return left;
+        }
+    }
+
+    m_nodes.push_back({ type, value, left, right });
+    return static_cast<int>(m_nodes.size()) - 1;
+}
+
+void arithmetic::skip_space()
+{
+    const string& text = *m_text;
+    while (m_pos < text.size() && (text[m_pos] == ' ' || text[m_pos] == '\t' || text[m_pos] == '\n' || text[m_pos] == '\r'))
+    {
+        m_pos++;
+    }
+}
+
+int arithmetic::parse_binary(int level)
+{
+    static const struct
+    {
+        const char* text;
+        op type;
+        int level;
+    } operators[] =
+    {
+        // Two-character operators come first, so they're matched before their prefixes.
+        { "||", op::logical_or, 0 },
+        { "&&", op::logical_and, 1 },
+        { "==", op::equal, 5 },
+        { "!=", op::not_equal, 5 },
+        { "<=", op::less_equal, 6 },
+        { ">=", op::greater_equal, 6 },
+        { "<<", op::shift_left, 7 },
+        { ">>", op::shift_right, 7 },
+        { "|", op::bit_or, 2 },
+        { "^", op::bit_xor, 3 },
+        { "&", op::bit_and, 4 },
+        { "<", op::less, 6 },
+        { ">", op::greater, 6 },
+        { "+", op::add, 8 },
+        { "-", op::subtract, 8 },
+        { "*", op::multiply, 9 },
+        { "/", op::divide, 9 },
+        { "%", op::modulo, 9 },
+    };
+
+    const size_t num_operators = sizeof(operators) / sizeof(operators[0]);
+
+    if (level == unary_level)
+    {
+        return parse_unary();
+    }
+
+    int left = parse_binary(level + 1);
+
+    while (m_error.empty())
+    {
+        skip_space();
+
+        const string& text = *m_text;
+        size_t found = 0;
+        for (; found < num_operators; found++)
+        {
+            if (text.compare(m_pos, strlen(operators[found].text), operators[found].text) == 0)
+            {
+                break;
+            }
+        }
+
+        if (found == num_operators || operators[found].level != level)
+        {
+            break;
+        }
+
+        m_pos += strlen(operators[found].text);
+        int right = parse_binary(level + 1);
+        left = add_node(operators[found].type, 0, left, right);
+    }
+
+    return left;
+}
+
+int arithmetic::parse_unary()
+{
+    const string& text = *m_text;
+    skip_space();
+
+    if (!m_error.empty() || m_pos == text.size())
+    {
+        if (m_error.empty())
+        {
+            m_error = "expected a number";
+        }
+        return add_node(op::constant, 0, -1, -1);
+    }
+
+    char c = text[m_pos];
+    switch (c)
+    {
+    case '-':
+    case '+':
+    case '!':
+    case '~':
+    {
+        m_pos++;
+        int operand = parse_unary();
+        switch (c)
+        {
+        case '-': return add_node(op::negate, 0, operand, -1);
+        case '!': return add_node(op::logical_not, 0, operand, -1);
+        case '~': return add_node(op::complement, 0, operand, -1);
+        default:  return operand;
+        }
+    }
+
+    case '(':
+    {
+        m_pos++;
+        int inner = parse_binary(0);
+        skip_space();
+        if (m_error.empty())
+        {
+            if (m_pos == text.size() || text[m_pos] != ')')
+            {
+                m_error = "expected \")\"";
+            }
+            else
+            {
+                m_pos++;
+            }
+        }
+        return inner;
+    }
+
+    case '$':
+    {
+        // Same rules for the name as in other expansions: a run of letters and digits, or one
+        // special character.
+        static const string special_characters = "#*@!_?$";
+
+        size_t start = ++m_pos;
+        if (m_pos < text.size() && special_characters.find(text[m_pos]) != string::npos)
+        {
+            m_pos++;
+        }
+        else
+        {
+            while (m_pos < text.size() && isalnum(static_cast<unsigned char>(text[m_pos])))
+            {
+                m_pos++;
+            }
+        }
+
+        if (m_pos == start)
+        {
+            m_error = "expected a variable name after \"$\"";
+            return add_node(op::constant, 0, -1, -1);
+        }
+
+        size_t slot = global_state::intern_var(text.substr(start, m_pos - start));
+        return add_node(op::variable, static_cast<long long>(slot), -1, -1);
+    }
+    }
+
+    if (is_digit(c))
+    {
+        unsigned long long value = 0;
+        if (c == '0' && m_pos + 1 < text.size() && (text[m_pos + 1] == 'x' || text[m_pos + 1] == 'X'))
+        {
+            m_pos += 2;
+            size_t start = m_pos;
+            for (; m_pos < text.size() && isxdigit(static_cast<unsigned char>(text[m_pos])); m_pos++)
+            {
+                char h = text[m_pos];
+                value = value * 16 + (is_digit(h) ? h - '0' : (h | 0x20) - 'a' + 10);
+            }
+            if (m_pos == start)
+            {
+                m_error = "expected hex digits after \"0x\"";
+            }
+        }
+        else
+        {
+            for (; m_pos < text.size() && is_digit(text[m_pos]); m_pos++)
+            {
+                value = value * 10 + (text[m_pos] - '0');
+            }
+        }
+
+        if (m_error.empty() && m_pos < text.size() && is_alnum(text[m_pos]))
+        {
+            m_error = "bad number \"" + text.substr(m_pos) + "\"";
+        }
+        return add_node(op::constant, wrap(value), -1, -1);
+    }
+    else if (is_name_start(c))
+    {
+        size_t start = m_pos;
+        while (m_pos < text.size() && is_alnum(text[m_pos]))
+        {
+            m_pos++;
+        }
+
+        size_t slot = global_state::intern_var(text.substr(start, m_pos - start));
+        return add_node(op::variable, static_cast<long long>(slot), -1, -1);
+    }
+
+    m_error = string("unexpected \"") + c + "\"";
+    return add_node(op::constant, 0, -1, -1);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+class global_state;
+
+// An integer arithmetic expression, as written inside $(( )). It's parsed once, and any parts of
+// it that don't depend on variables are worked out then.
+//
+// Numbers are 64-bit, and overflow wraps around. Variables can be written as "name" or "$name";
+// their values are taken as numbers the same way the if-operators do. The operators and their
+// precedence are the same as in C:
+//
+//     unary - + ! ~
+//     * / %
+//     + -
+//     << >>
+//     < <= > >=
+//     == !=
+//     &
+//     ^
+//     |
+//     &&
+//     ||
+class arithmetic
+{
+public:
+    arithmetic(const std::string& text);
+
+    // Given where the text inside "$((" starts, find the "))" that closes it. Returns the position
+    // of the first ')', or npos if it isn't closed.
+    static size_t find_end(const std::string& text, size_t start);
+
+    // True if the expression doesn't use any variables (and is valid), so it always has the same
+    // value, which is returned in value.
+    bool is_constant(long long& value) const;
+
+    // Work out the value. Errors (syntax errors, and division by zero) are reported to err and set
+    // the error flag.
+    long long evaluate(global_state& state, std::ostream& err) const;
+
+private:
+    enum class op
+    {
+        constant,
+        variable,
+        negate,
+        logical_not,
+        complement,
+        multiply,
+        divide,
+        modulo,
+        add,
+        subtract,
+        shift_left,
+        shift_right,
+        less,
+        less_equal,
+        greater,
+        greater_equal,
+        equal,
+        not_equal,
+        bit_and,
+        bit_xor,
+        bit_or,
+        logical_and,
+        logical_or,
+    };
+
+    struct node
+    {
+        op type;
+        long long value;                // constant: the value. variable: the slot.
+        int left;                       // Operands (indexes into m_nodes).
+        int right;
+    };
+
+    int parse_binary(int level);
+    int parse_unary();
+    int add_node(op type, long long value, int left, int right);
+    void skip_space();
+
+    long long evaluate(int index, global_state& state, std::ostream& err) const;
+    static bool apply(op type, long long a, long long b, long long& result);
+
+    std::vector<node> m_nodes;
+    int m_root;
+    std::string m_error;
+
+    // Only used while parsing.
+    const std::string* m_text;
+    size_t m_pos;
+};
@@ -3,18 +3,26 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <map>
 #include <unordered_map>
 #include <string>
 #include <memory>
 #include <algorithm>
 #include <functional>
 #include <sstream>
+#include <thread>
 #include <string.h>
 
 #include "common.h"
 #include "global_state.h"
 #include "repl.h"
 #include "commandlets.h"
+#include "pipeline.h"
+#include "parallel.h"
+#include "process.h"
+#include "expansion.h"
+#include "arithmetic.h"
+#include "script.h"
 
 using namespace std;
 
@@ -22,16 +30,21 @@ int let_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& st
 {
     if (args.size() == 0)
     {
-        for (const auto& pair : state.environment)
+        for (size_t i = 0, n = state.variables.size(); i < n; i++)
         {
-            if (state.local_vars.find(pair.first) == state.local_vars.end())
+            const auto& var = state.variables[i];
+            if (var.has_environment && !var.has_local)
             {
-                out << pair.first << "=" << pair.second << endl;
+                out << global_state::var_name(i) << "=" << var.environment << endl;
             }
         }
-        for (const auto& pair : state.local_vars)
+        for (size_t i = 0, n = state.variables.size(); i < n; i++)
         {
-            out << pair.first << "=" << pair.second << endl;
+            const auto& var = state.variables[i];
+            if (var.has_local)
+            {
+                out << global_state::var_name(i) << "=" << var.local << endl;
+            }
         }
     }
     else if (args.size() != 3 || args[1] != "=")
@@ -42,7 +55,7 @@ int let_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& st
     }
     else
     {
-        state.let(args[0], args[2]);
+        state.let(args[0], move(args[2]));
     }
 
     return 0;
@@ -69,32 +82,29 @@ int list_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& s
         return -1;
     }
 
-    for (const auto& line : state.stored_program)
+    auto print_line = [&out](const pair<const int, global_state::program_line>& line)
     {
-        bool match = false;
-        if (args.size() == 1)
-        {
-            if (line.number == args[0])
-            {
-                match = true;
-            }
-            else
-            {
-                continue;
-            }
-        }
-
-        out << line.number << " " << line.command;
-        for (const auto& arg : line.args)
+        out << line.first << " " << line.second.command;
+        for (const auto& arg : line.second.args)
         {
             out << " " << arg;
         }
         out << endl;
+    };
 
-        if (match)
+    if (args.size() == 1)
+    {
+        auto pos = state.stored_program.find(atoi(args[0].c_str()));
+        if (pos != state.stored_program.end())
         {
-            break;
+            print_line(*pos);
         }
+        return 0;
+    }
+
+    for (const auto& line : state.stored_program)
+    {
+        print_line(line);
     }
     return 0;
 }
@@ -120,22 +130,39 @@ int run_commandlet(istream& in, ostream& out, ostream& err, global_state& state,
     {
         start = atoi(args[0].c_str());
     }
-    
-    state.interactive = false;
-    stringstream program_stream;
-    for (const auto& line : state.stored_program)
+
+    if (state.stored_program_script == nullptr)
     {
-        if (atoi(line.number.c_str()) >= start)
+        // Compile the program once; it stays compiled until a line is changed.
+        auto program = make_shared<script>();
+        for (auto& line : state.stored_program)
         {
-            program_stream << line.command;
-            for (const auto& arg : line.args)
-            {
-                program_stream << " " << arg;
-            }
-            program_stream << endl;
+            parsed_line parsed = { string(), line.second.command, line.second.args };
+            program->add_label(line.first);
+            program->add_line(parsed);
+        }
+
+        if (program->open_block() != nullptr)
+        {
+            err << "Syntax error: expected '" << program->open_block() << "' before the end of the program\n";
+            state.error = true;
+            return -1;
         }
+
+        state.stored_program_script = move(program);
     }
-    int retval = repl(program_stream, out, err, state, in);
+
+    // Hold a reference, in case the program is changed (or cleared with 'new') while it runs.
+    shared_ptr<script> program = state.stored_program_script;
+
+    size_t pc;
+    if (!program->find_line(start, pc))
+    {
+        return 0;
+    }
+
+    state.interactive = false;
+    int retval = program->run(in, out, err, state, 0, pc);
     state.interactive = true;
 
     return retval;
@@ -151,6 +178,7 @@ int new_commandlet(istream& /*in*/, ostream& /*out*/, ostream& err, global_state
     }
 
     state.stored_program.clear();
+    state.stored_program_script = nullptr;
 
     return 0;
 }
@@ -255,14 +283,266 @@ int pwd_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& st
     return 0;
 }
 
+int hash_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& state, vector<string>& args)
+{
+    if (args.empty())
+    {
+        // List the commands that have been found.
+        vector<pair<string, string>> found;
+        for (const auto& entry : state.command_paths)
+        {
+            if (!entry.second.empty())
+            {
+                found.push_back(entry);
+            }
+        }
+        sort(found.begin(), found.end());
+
+        for (const auto& entry : found)
+        {
+            out << entry.first << "=" << entry.second << endl;
+        }
+        return 0;
+    }
+
+    if (args.size() == 1 && args[0] == "-r")
+    {
+        state.command_paths.clear();
+        return 0;
+    }
+
+    // Look up the given commands, again.
+    int result = 0;
+    for (const string& name : args)
+    {
+        state.command_paths.erase(name);
+
+        string path;
+        if (!state.find_command(name, path))
+        {
+            err << "hash: " << name << ": not found\n";
+            result = 1;
+        }
+    }
+    return result;
+}
+
+int jobs_commandlet(istream& /*in*/, ostream& out, ostream& err, global_state& state, vector<string>& args)
+{
+    if (args.size() != 0)
+    {
+        err << "Syntax error: 'jobs' expects no arguments.\n";
+        state.error = true;
+        return -1;
+    }
+
+    report_jobs(state, out, true);
+    return 0;
+}
+
+// Take the first job that has finished out of the job table. Returns false if none have.
+static bool take_finished_job(global_state& state, int* pExitCode)
+{
+    for (size_t i = 0; i < state.jobs.size(); i++)
+    {
+        if (finish_job(state, i, false, pExitCode))
+        {
+            state.jobs.erase(state.jobs.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int wait_for_jobs(global_state& state, const vector<string>& args, ostream& err)
+{
+    int exitCode = 0;
+    if (args.empty())
+    {
+        // Wait for all of them, and take each one out of the table as soon as it's done.
+        while (!state.jobs.empty())
+        {
+            if (!take_finished_job(state, &exitCode))
+            {
+                wait_for_any_job(state);
+            }
+        }
+        return 0;
+    }
+
+    if (args.size() == 1 && args[0] == "-n")
+    {
+        // Wait for whichever one finishes first.
+        if (state.jobs.empty())
+        {
+            return 127;
+        }
+        while (!take_finished_job(state, &exitCode))
+        {
+            wait_for_any_job(state);
+        }
+        return exitCode;
+    }
+
+    for (const string& spec : args)
+    {
+        size_t index;
+        if (!find_job(state, spec, index))
+        {
+            err << "wait: no such job: " << spec << "\n";
+            exitCode = 127;
+            continue;
+        }
+
+        finish_job(state, index, true, &exitCode);
+        state.jobs.erase(state.jobs.begin() + index);
+    }
+    return exitCode;
+}
+
+int wait_commandlet(istream& /*in*/, ostream& /*out*/, ostream& err, global_state& state, vector<string>& args)
+{
+    // The exit code of what was waited for is the point, so unlike most commandlets, this sets $?.
+    int exitCode = wait_for_jobs(state, args, err);
+    state.let(global_state::status_slot, to_string(exitCode));
+    return exitCode;
+}
+
+// Add the lines of text to items, skipping empty ones.
+static void split_lines(const string& text, vector<string>& items)
+{
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+
+        size_t len = end - start;
+        if (len > 0 && text[end - 1] == '\r')
+        {
+            len--;
+        }
+        if (len > 0)
+        {
+            items.push_back(text.substr(start, len));
+        }
+        start = end + 1;
+    }
+}
+
+// parallel [-j N] command [args...] [::: inputs...]
+// Without ":::", the inputs are the lines of stdin. Sets $? to the number of runs that failed.
+int parallel_commandlet(istream& in, ostream& out, ostream& err, global_state& state, vector<string>& args)
+{
+    size_t jobs = thread::hardware_concurrency();
+    size_t first = 0;
+    if (!args.empty() && args[0].compare(0, 2, "-j") == 0)
+    {
+        string count = args[0].substr(2);
+        first = 1;
+        if (count.empty() && args.size() > 1)
+        {
+            count = args[1];
+            first = 2;
+        }
+
+        long long n = to_number(count);
+        if (n <= 0 || to_string(n) != count)
+        {
+            err << "Syntax error: 'parallel -j' expects a number of jobs, not \"" << count << "\".\n";
+            state.error = true;
+            return -1;
+        }
+        jobs = static_cast<size_t>(n);
+    }
+    jobs = max<size_t>(jobs, 1);
+
+    auto separator = find(args.begin() + first, args.end(), ":::");
+    if (separator == args.begin() + first)
+    {
+        err << "Syntax error: 'parallel' expects a command.\n";
+        state.error = true;
+        return -1;
+    }
+
+    // As with foreach, multi-line inputs (such as backtick output) are split into lines.
+    vector<string> inputs;
+    if (separator != args.end())
+    {
+        for (auto i = separator + 1; i != args.end(); ++i)
+        {
+            if (i->find('\n') == string::npos)
+            {
+                inputs.push_back(move(*i));
+            }
+            else
+            {
+                split_lines(*i, inputs);
+            }
+        }
+    }
+    else
+    {
+        string line;
+        while (getline(in, line))
+        {
+            split_lines(line, inputs);
+        }
+    }
+
+    vector<string> command_args(args.begin() + first + 1, separator);
+    int failures = run_parallel(args[first], command_args, inputs, jobs, out, err, state);
+    state.let(global_state::status_slot, to_string(failures));
+    return failures;
+}
+
+int exec_commandlet(istream& in, ostream& out, ostream& err, global_state& state, vector<string>& args)
+{
+    if (args.empty())
+    {
+        err << "Syntax error: 'exec' expects a command to run.\n";
+        state.error = true;
+        return -1;
+    }
+
+    string path;
+    if (!state.find_command(args[0], path))
+    {
+        err << "Error: command not found: " << args[0] << endl;
+        state.error = true;
+        return -1;
+    }
+
+    Process p(args[0], vector<string>(args.begin() + 1, args.end()), path);
+
+    // An interactive shell has to put the console back the way it was when it exits.
+    if (!state.interactive)
+    {
+        p.Exec(in, out, err);
+    }
+
+    // It couldn't take the shell's place, so run it, and then exit.
+    int exitCode;
+    if (!p.Run(in, out, err, &exitCode))
+    {
+        err << "process failed!\n";
+        state.error = true;
+        return -1;
+    }
+
+    state.let(global_state::status_slot, to_string(exitCode));
+    state.exit = true;
+    return exitCode;
+}
+
 #define DEFINE_COMMANDLET(name) { #name, name##_commandlet }
 
 unordered_map<string, commandlet_function> special_functions(
 {
     DEFINE_COMMANDLET(let),
-    DEFINE_COMMANDLET(if),      // defined in if_else_endif.cpp
-    DEFINE_COMMANDLET(else),    //
-    DEFINE_COMMANDLET(endif),   //
     DEFINE_COMMANDLET(echo),
     DEFINE_COMMANDLET(list),
     DEFINE_COMMANDLET(run),
@@ -270,4 +550,9 @@ unordered_map<string, commandlet_function> special_functions(
     DEFINE_COMMANDLET(exit),
     DEFINE_COMMANDLET(cd),
     DEFINE_COMMANDLET(pwd),
+    DEFINE_COMMANDLET(hash),
+    DEFINE_COMMANDLET(jobs),
+    DEFINE_COMMANDLET(wait),
+    DEFINE_COMMANDLET(parallel),
+    DEFINE_COMMANDLET(exec),
 });
@@ -21,12 +21,14 @@ COMMANDLET(echo);
 COMMANDLET(list);
 COMMANDLET(run);
 COMMANDLET(new);
-COMMANDLET(if);
-COMMANDLET(else);
-COMMANDLET(endif);
 COMMANDLET(exit);
 COMMANDLET(cd);
 COMMANDLET(pwd);
+COMMANDLET(hash);
+COMMANDLET(jobs);
+COMMANDLET(wait);
+COMMANDLET(parallel);
+COMMANDLET(exec);
 
 #undef COMMANDLET
 
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <string>
+#include <cstdlib>
 
 #include "common.h"
 
@@ -102,4 +103,15 @@ int compare_string_nocase(const std::string& a, const std::string& b)
     return compare_string_nocase(wa, wb);
 }
 
-#endif
\ No newline at end of file
+#endif
+
+long long to_number(const string& text)
+{
+    return strtoll(text.c_str(), nullptr, 10);
+}
+
+void strip_trailing_newlines(string& text)
+{
+    size_t end = text.find_last_not_of('\n');
+    text.resize((end == string::npos) ? 0 : end + 1);
+}
@@ -2,6 +2,13 @@
 
 std::string get_current_working_directory(std::ostream& errors_output);
 
+// The number at the start of some text, the same way atoi() reads it, but 64-bit. Text that
+// doesn't start with a number is zero.
+long long to_number(const std::string& text);
+
+// Remove the newlines from the end of a command's output, as backticks do.
+void strip_trailing_newlines(std::string& text);
+
 #ifdef _MSC_VER
 
 #define WIN32_LEAN_AND_MEAN
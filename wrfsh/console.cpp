@@ -7,11 +7,16 @@
 #include <streambuf>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
+#include <map>
 #include <regex>
+#include <cstring>
+#include <cstdint>
 
 #include "common.h"
 #include "global_state.h"
+#include "history.h"
 #include "console.h"
 
 using namespace std;
@@ -25,9 +30,77 @@ Console* Console::make()
 #endif
 }
 
+Console_streambuf::Console_streambuf(Console* con)
+    : m_console(con)
+{
+    setp(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+Console_streambuf::Console_streambuf(const Console_streambuf& other)
+    : m_console(other.m_console)
+{
+    setp(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+Console_streambuf::int_type Console_streambuf::overflow(int_type c)
+{
+    put_pending();
+    if (c != traits_type::eof())
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+streamsize Console_streambuf::xsputn(const char* s, streamsize n)
+{
+    if (n <= epptr() - pptr())
+    {
+        memcpy(pptr(), s, static_cast<size_t>(n));
+        pbump(static_cast<int>(n));
+    }
+    else
+    {
+        // It doesn't fit, so it goes straight on after what's already there.
+        put_pending();
+        m_console->write_output(string(s, static_cast<size_t>(n)));
+    }
+
+    if (memchr(s, '\n', static_cast<size_t>(n)) != nullptr)
+    {
+        sync();
+    }
+    return n;
+}
+
+int Console_streambuf::sync()
+{
+    put_pending();
+    m_console->flush_output();
+    return 0;
+}
+
+void Console_streambuf::put_pending()
+{
+    if (pptr() != pbase())
+    {
+        m_console->write_output(string(pbase(), pptr()));
+        setp(m_buffer, m_buffer + sizeof(m_buffer));
+    }
+}
+
+namespace
+{
+    // How many of the most recent lines Up and Down go through. Searches go through all of them.
+    const size_t recent_history_lines = 1000;
+}
+
 Console::Console()
-    : m_currentInputLineIdx(0)
+    : m_history(new History(recent_history_lines))
+    , m_historyIdx(0)
     , m_currentInputLinePos(0)
+    , m_shownPos(0)
 {
 }
 
@@ -35,8 +108,24 @@ Console::~Console()
 {
 }
 
+void Console::open_history(const string& path)
+{
+    m_history.reset(new History(recent_history_lines));
+    m_history->open(path);
+}
+
 void Console::prompt(global_state& state)
 {
+    // Anything a command left at the end of the output goes before the prompt.
+    ostream().flush();
+
+    if (state.pending_script != nullptr)
+    {
+        // Continuing a loop.
+        write_output("> ", CharAttr::FG_Green | CharAttr::FG_Bold);
+        return;
+    }
+
     write_output(state.lookup_var("USER"), CharAttr::FG_Green);
     write_output("@");
     write_output(state.lookup_var("HOST"), CharAttr::FG_Green);
@@ -71,81 +160,88 @@ void Console::prompt(global_state& state)
 
 string Console::get_input_line()
 {
+    // The prompt has just been written, and nothing after it.
+    m_shownLine.clear();
+    m_shownPos = 0;
+    begin_line();
     new_empty_line();
 
     for (;;)
     {
+        // Each key only changes the line; then the screen is brought up to date with it.
         Input c = get_input_char();
+        if (c.type == Input::Type::Special && c.special == Input::Special::Search)
+        {
+            c = search_history();
+        }
+
+        native_string_t& line = m_inputLine;
         if (c.type == Input::Type::Special)
         {
             switch (c.special)
             {
             case Input::Special::Eof:
+                end_line();
                 return "echo \"Console EOF\"\nexit";
             case Input::Special::Down:
-                if (m_currentInputLineIdx < m_inputLines.size() - 1)
+                if (m_historyIdx < m_history->size())
                 {
-                    replace_current_line(static_cast<int>(m_currentInputLineIdx) + 1);
-                    m_currentInputLinePos = m_inputLines[m_currentInputLineIdx].size();
+                    ++m_historyIdx;
+                    line = (m_historyIdx == m_history->size())
+                        ? m_newInputLine
+                        : Widen((*m_history)[m_historyIdx]);
+                    m_currentInputLinePos = line.size();
                 }
                 break;
             case Input::Special::Up:
-                if (m_currentInputLineIdx > 0)
+                if (m_historyIdx > 0)
                 {
-                    replace_current_line(static_cast<int>(m_currentInputLineIdx) - 1);
-                    m_currentInputLinePos = m_inputLines[m_currentInputLineIdx].size();
+                    if (m_historyIdx == m_history->size())
+                    {
+                        m_newInputLine = line;
+                    }
+                    --m_historyIdx;
+                    line = Widen((*m_history)[m_historyIdx]);
+                    m_currentInputLinePos = line.size();
                 }
                 break;
             case Input::Special::Left:
-                if (!m_inputLines[m_currentInputLineIdx].empty()
-                    && m_currentInputLinePos > 0)
+                if (m_currentInputLinePos > 0)
                 {
-                    advance_cursor_pos(-1);
                     --m_currentInputLinePos;
                 }
                 break;
             case Input::Special::Right:
-                if (m_inputLines[m_currentInputLineIdx].size() > m_currentInputLinePos)
+                if (m_currentInputLinePos < line.size())
                 {
-                    advance_cursor_pos(1);
                     ++m_currentInputLinePos;
                 }
                 break;
             case Input::Special::Home:
-                advance_cursor_pos(-1 * static_cast<int>(m_currentInputLinePos));
                 m_currentInputLinePos = 0;
                 break;
             case Input::Special::End:
-                {
-                    size_t size = m_inputLines[m_currentInputLineIdx].size();
-                    advance_cursor_pos(static_cast<int>(size - m_currentInputLinePos));
-                    m_currentInputLinePos = size;
-                }
+                m_currentInputLinePos = line.size();
                 break;
             case Input::Special::Return:
+                refresh_input_line();
+                move_input_cursor(line.size());
                 m_currentInputLinePos = 0;
+                end_line();
                 echo_char('\n');
-                return Narrow(m_inputLines[m_currentInputLineIdx]);
+                m_history->add(Narrow(line));
+                return Narrow(line);
             case Input::Special::Backspace:
                 if (m_currentInputLinePos > 0)
                 {
                     --m_currentInputLinePos;
-                    m_inputLines[m_currentInputLineIdx].erase(m_currentInputLinePos, 1);
-                    advance_cursor_pos(-1);
-                    native_string_t str = m_inputLines[m_currentInputLineIdx].substr(m_currentInputLinePos);
-                    echo_string(str);
-                    echo_char(L' ');
-                    advance_cursor_pos(-1 - static_cast<int>(str.size()));
+                    line.erase(m_currentInputLinePos, 1);
                 }
                 break;
             case Input::Special::Delete:
-                if (m_currentInputLinePos < m_inputLines[m_currentInputLineIdx].size())
+                if (m_currentInputLinePos < line.size())
                 {
-                    m_inputLines[m_currentInputLineIdx].erase(m_currentInputLinePos, 1);
-                    native_string_t str = m_inputLines[m_currentInputLineIdx].substr(m_currentInputLinePos);
-                    echo_string(str);
-                    echo_char(L' ');
-                    advance_cursor_pos(-1 - static_cast<int>(str.size()));
+                    line.erase(m_currentInputLinePos, 1);
                 }
                 else
                     ding();
@@ -154,47 +250,192 @@ string Console::get_input_line()
                 throw new exception();
             }
         }
+        else if (c.type == Input::Type::Text)
+        {
+            line.insert(m_currentInputLinePos, c.text);
+            m_currentInputLinePos += c.text.size();
+        }
         else // (c.type == Input::Type::Character)
         {
-            echo_char(c.character);
-            m_inputLines[m_currentInputLineIdx].insert(m_currentInputLinePos, 1, c.character);
+            line.insert(m_currentInputLinePos, 1, c.character);
             ++m_currentInputLinePos;
-            if (m_currentInputLinePos < m_inputLines[m_currentInputLineIdx].size())
-            {
-                // Echo the rest of the line because we inserted in the middle of the line.
-                echo_string(m_inputLines[m_currentInputLineIdx].substr(m_currentInputLinePos));
-                advance_cursor_pos(static_cast<int>(m_currentInputLinePos) - static_cast<int>(m_inputLines[m_currentInputLineIdx].size()));
-            }
+        }
+
+        // Keys that arrived together (such as pasted text) are all applied before it's drawn.
+        if (!input_pending())
+        {
+            refresh_input_line();
         }
     } // for(;;)
 }
 
 void Console::new_empty_line()
 {
-    if (m_inputLines.empty() || !m_inputLines.back().empty())
+    m_inputLine.clear();
+    m_newInputLine.clear();
+    m_historyIdx = m_history->size();
+    m_currentInputLinePos = 0;
+    refresh_input_line();
+}
+
+// Search back through the history as the text to find is typed, showing the newest line with it
+// in place of the input line. Ctrl-R goes on to the next older one. Any other key ends the search
+// with the line found as the input line, and is returned to be handled as usual.
+Console::Input Console::search_history()
+{
+    string text;
+    string found = Narrow(m_inputLine);
+    size_t position = History::from_newest;
+    bool failed = false;
+
+    // The lines found before the current one. Those are all the lines newer than it that have the
+    // text, so older copies of them are passed over.
+    unordered_set<string> passed;
+
+    for (;;)
+    {
+        if (!input_pending())
+        {
+            const string label = failed ? "(failed search)`" : "(search)`";
+            show_line(Widen(label + text + "': " + found), label.size() + text.size());
+        }
+
+        Input c = get_input_char();
+        size_t start = position;
+        if (c.type == Input::Type::Character)
+        {
+            text += Narrow(native_string_t(1, c.character));
+            start = (position == History::from_newest) ? position : position + 1;
+        }
+        else if (c.type == Input::Type::Text)
+        {
+            text += Narrow(c.text);
+            start = (position == History::from_newest) ? position : position + 1;
+        }
+        else if (c.special == Input::Special::Backspace && !text.empty())
+        {
+            text.pop_back();
+            start = History::from_newest;
+            passed.clear();
+        }
+        else if (c.special == Input::Special::Search)
+        {
+            if (position != History::from_newest)
+            {
+                passed.insert(found);
+            }
+        }
+        else
+        {
+            m_inputLine = Widen(found);
+            m_historyIdx = m_history->size();
+            m_currentInputLinePos = m_inputLine.size();
+            return c;
+        }
+
+        string line;
+        if (m_history->search(text, passed, start, line))
+        {
+            found = move(line);
+            position = start;
+            failed = false;
+        }
+        else
+        {
+            failed = true;
+            ding();
+        }
+    }
+}
+
+void Console::refresh_input_line()
+{
+    show_line(m_inputLine, m_currentInputLinePos);
+}
+
+// Make the screen show the given line, with the cursor at pos in it. Only the part that's changed
+// is written: the characters that are the same at the start and the end are left alone, and a
+// plain insertion or deletion in between is done by the console where it can.
+void Console::show_line(const native_string_t& line, size_t pos)
+{
+    const size_t shown = m_shownLine.size();
+
+    size_t prefix = 0;
+    while (prefix < shown && prefix < line.size() && m_shownLine[prefix] == line[prefix])
+    {
+        prefix++;
+    }
+
+    size_t suffix = 0;
+    while (suffix < shown - prefix && suffix < line.size() - prefix
+        && m_shownLine[shown - 1 - suffix] == line[line.size() - 1 - suffix])
+    {
+        suffix++;
+    }
+
+    const size_t removed = shown - prefix - suffix;
+    const size_t added = line.size() - prefix - suffix;
+    if (removed != 0 || added != 0)
+    {
+        move_input_cursor(prefix);
+        if (removed == 0 && insert_blanks(added, suffix))
+        {
+            echo_string(line.substr(prefix, added));
+            m_shownPos = prefix + added;
+        }
+        else if (added == 0 && delete_chars(removed, suffix))
+        {
+        }
+        else
+        {
+            echo_string(line.substr(prefix));
+            m_shownPos = line.size();
+            if (line.size() < shown)
+            {
+                clear_to_end(shown - line.size());
+            }
+        }
+        m_shownLine = line;
+    }
+
+    move_input_cursor(pos);
+}
+
+void Console::move_input_cursor(size_t pos)
+{
+    if (pos != m_shownPos)
     {
-        m_inputLines.push_back(native_string_t());
+        advance_cursor_pos(static_cast<int>(pos) - static_cast<int>(m_shownPos));
+        m_shownPos = pos;
     }
-    replace_current_line(static_cast<int>(m_inputLines.size()) - 1);
 }
 
-void Console::replace_current_line(int newIndex)
+bool Console::input_pending()
 {
-    clear_current_display_line();
+    return false;
+}
 
-    m_currentInputLineIdx = newIndex;
-    echo_string(m_inputLines[m_currentInputLineIdx]);
-    m_currentInputLinePos = static_cast<int>(m_inputLines[m_currentInputLineIdx].size());
+void Console::begin_line()
+{
 }
 
-void Console::clear_current_display_line()
+void Console::end_line()
 {
-    int currentLineLen = 0;
-    if (!m_inputLines.empty())
-        currentLineLen = static_cast<int>(m_inputLines[m_currentInputLineIdx].size());
+}
 
-    advance_cursor_pos(-1 * static_cast<int>(m_currentInputLinePos));
-    echo_string(native_string_t(currentLineLen, static_cast<native_string_t::value_type>(' ')));
-    advance_cursor_pos(-1 * currentLineLen);
-    m_currentInputLinePos = 0;
+void Console::clear_to_end(size_t n)
+{
+    echo_string(native_string_t(n, static_cast<native_string_t::value_type>(' ')));
+    advance_cursor_pos(-static_cast<int>(n));
+}
+
+bool Console::insert_blanks(size_t /*n*/, size_t tail)
+{
+    // Nothing has to move at the end of the line.
+    return tail == 0;
+}
+
+bool Console::delete_chars(size_t /*n*/, size_t /*tail*/)
+{
+    return false;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 class global_state;
+class History;
 
 class Console
 {
@@ -30,6 +31,7 @@ public:
         {
             Character = 0,
             Special = 1,
+            Text = 2,           // Pasted text, to be inserted all at once.
         };
 
         // These values are the same as the VK_* codes in Win32.
@@ -46,6 +48,8 @@ public:
             Right = 0x27,
             Down = 0x28,
             Delete = 0x2e,
+
+            Search = 0x100,     // Not a key code: ctrl-R, to search back through the history.
         };
 
         Type type;
@@ -54,6 +58,7 @@ public:
             native_string_t::value_type character;
             Special special;
         };
+        native_string_t text;
     };
 
     static Console* make();
@@ -62,24 +67,48 @@ public:
 
     std::string get_input_line();
     void prompt(global_state& state);
+    void open_history(const std::string& path);
 
     virtual Input get_input_char() = 0;
+    virtual bool input_pending();       // Whether get_input_char() has more without waiting.
+    virtual void begin_line();          // Called around reading each line, for consoles that
+    virtual void end_line();            // change how the terminal works while it's edited.
     virtual void write_output(const std::string& s, CharAttr attrs = CharAttr::Default) = 0;
+    virtual void flush_output() = 0;    // Put everything written so far on the screen.
     virtual std::ostream& ostream() = 0;
     virtual void advance_cursor_pos(int n) = 0;
     virtual void ding() = 0;
 
 protected:
     void new_empty_line();
-    void replace_current_line(int newIndex);
-    void clear_current_display_line();
+    Input search_history();
+    void refresh_input_line();
+    void show_line(const native_string_t& line, size_t pos);
+    void move_input_cursor(size_t pos);
 
     virtual void echo_char(native_string_t::value_type c, CharAttr attrs = CharAttr::Default) = 0;
     virtual void echo_string(const native_string_t& s, CharAttr attrs = CharAttr::Default) = 0;
 
-    std::vector<native_string_t> m_inputLines;
-    size_t m_currentInputLineIdx;
+    // Editing operations that consoles can do more cheaply than rewriting the line. The cursor
+    // stays where it is, and tail is how many characters of the line are after the ones affected.
+    // insert_blanks() and delete_chars() return false if they can't be done (and nothing's been
+    // changed); then the rest of the line is written out again instead.
+    virtual void clear_to_end(size_t n);                // Blank the last n characters shown.
+    virtual bool insert_blanks(size_t n, size_t tail);  // Move the rest of the line right by n.
+    virtual bool delete_chars(size_t n, size_t tail);   // Remove n, moving the rest of the line left.
+
+    // The line being edited. While going back through the history with Up and Down,
+    // m_historyIdx is which of its lines this is a copy of, and m_newInputLine is what had been
+    // typed before that.
+    std::unique_ptr<History> m_history;
+    native_string_t m_inputLine;
+    native_string_t m_newInputLine;
+    size_t m_historyIdx;
     size_t m_currentInputLinePos;
+
+    // The input line as it is on the screen (after the prompt), and where the cursor is in it.
+    native_string_t m_shownLine;
+    size_t m_shownPos;
 };
 
 inline Console::CharAttr operator|(Console::CharAttr x, Console::CharAttr y)
@@ -96,37 +125,23 @@ inline Console::CharAttr operator&(Console::CharAttr x, Console::CharAttr y)
         );
 }
 
+// Output to the console is collected here, and given to it a batch at a time: when a line is
+// finished, when the buffer is full, and when the stream is flushed.
 class Console_streambuf : public std::streambuf
 {
 public:
-    Console_streambuf(Console* con) : m_console(con)
-    {}
-
-    Console_streambuf(const Console_streambuf& other)
-        : m_console(other.m_console)
-    {}
-
-    int_type overflow(int_type c = traits_type::eof())
-    {
-        if (c == traits_type::eof())
-        {
-            return traits_type::eof();
-        }
-        else
-        {
-            char_type ch = traits_type::to_char_type(c);
-            return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
-        }
-    }
+    Console_streambuf(Console* con);
+    Console_streambuf(const Console_streambuf& other);
 
-    std::streamsize xsputn(const char* s, std::streamsize n)
-    {
-        m_console->write_output(std::string(s, n));
-        return n;
-    }
+    int_type overflow(int_type c = traits_type::eof());
+    std::streamsize xsputn(const char* s, std::streamsize n);
+    int sync();
 
 private:
+    void put_pending();
+
     Console* m_console;
+    char m_buffer[4096];
 };
 
 template <typename T>
@@ -160,6 +175,7 @@ public:
 
     virtual Console::Input get_input_char();
     virtual void write_output(const std::string& s, CharAttr attrs = CharAttr::Default);
+    virtual void flush_output();
     virtual std::ostream& ostream();
     virtual void advance_cursor_pos(int n);
     virtual void ding();
@@ -195,7 +211,11 @@ public:
     ~Console_Posix();
 
     virtual Console::Input get_input_char();
+    virtual bool input_pending();
+    virtual void begin_line();
+    virtual void end_line();
     virtual void write_output(const std::string& s, CharAttr attrs = CharAttr::Default);
+    virtual void flush_output();
     virtual std::ostream& ostream();
     virtual void advance_cursor_pos(int n);
     virtual void ding();
@@ -203,15 +223,38 @@ public:
 protected:
     virtual void echo_char(char c, CharAttr attrs = CharAttr::Default);
     virtual void echo_string(const std::string& s, CharAttr attrs = CharAttr::Default);
+    virtual void clear_to_end(size_t n);
+    virtual bool insert_blanks(size_t n, size_t tail);
+    virtual bool delete_chars(size_t n, size_t tail);
 
 private:
-    bool vt_escape();
+    bool decode_input();
+    bool decode_paste();
+    void push_paste_text();
+    bool read_input();
     void get_window_info();
+    void set_color(CharAttr attrs);
+    void track_cursor(const char* s, size_t n);
 
     std::unique_ptr<Console_streambuf> m_streambuf;
     std::ostream m_ostream;
     std::deque<Console::Input> m_pendingInputs;
 
+    // Bytes read from the terminal that haven't been decoded into inputs yet.
+    char m_inputBuffer[4096];
+    size_t m_inputStart;
+    size_t m_inputEnd;
+
+    // Text being pasted, while the terminal is between its bracketed paste start and end markers.
+    bool m_pasting;
+    bool m_pasteAfterCR;
+    std::string m_pasteText;
+
+    // Everything for the terminal (text, colors and cursor movement) is collected here until it's
+    // flushed, and then written all at once. m_color is the color it leaves the text in.
+    std::string m_pending;
+    CharAttr m_color;
+
     struct Details;
     Details* m_details;
 };
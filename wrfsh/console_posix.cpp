@@ -5,6 +5,9 @@
 #include <memory>
 #include <vector>
 #include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
 
 #include <termio.h>
 
@@ -29,6 +32,11 @@ struct Console_Posix::Details
 Console_Posix::Console_Posix()
     : m_streambuf(new Console_streambuf(this))
     , m_ostream(m_streambuf.get())
+    , m_inputStart(0)
+    , m_inputEnd(0)
+    , m_pasting(false)
+    , m_pasteAfterCR(false)
+    , m_color(CharAttr::Default)
 {
     m_details = new Details;
     
@@ -48,6 +56,7 @@ Console_Posix::Console_Posix()
 
 Console_Posix::~Console_Posix()
 {
+    m_ostream.flush();
     tcsetattr(STDIN_FILENO, TCSANOW, &(m_details->savedTermios));
 
     delete m_details;
@@ -85,7 +94,7 @@ void Console_Posix::advance_cursor_pos(int n)
             // Use the "force cursor position" sequence instead.
             num = snprintf(str, countof(str), "\033[%d;%df", m_details->cursor.y + 1, m_details->cursor.x + 1);
         }
-        write(STDOUT_FILENO, str, num);
+        m_pending.append(str, num);
     }
 }
 
@@ -94,177 +103,329 @@ ostream& Console_Posix::ostream()
     return m_ostream;
 }
 
-bool Console_Posix::vt_escape()
+namespace
 {
-    Input input = {};
-    input.type = Input::Type::Special;
+    typedef Console::Input::Special Special;
 
-    string buf;
+    // Keys that send a control character.
+    const struct
+    {
+        char c;
+        Special special;
+    } control_keys[] =
+    {
+        { '\r', Special::Return },
+        { '\n', Special::Return },
+        { 127, Special::Backspace },    // ASCII DEL
+        { 4, Special::Eof },            // ASCII EOT (ctrl-D)
+        { 18, Special::Search },        // ctrl-R
+    };
 
-    char c;
-    int arg[16] = {};
-    size_t arg_num = 0;
+    // Keys that send an escape sequence: what comes after the ESC. Keys pressed with modifiers
+    // add parameters before the last character ("[1;5C"); those are looked up as "[C".
+    const struct
+    {
+        const char* sequence;
+        Special special;
+    } escape_keys[] =
+    {
+        { "[A", Special::Up },
+        { "[B", Special::Down },
+        { "[C", Special::Right },
+        { "[D", Special::Left },
+        { "[H", Special::Home },
+        { "[F", Special::End },
+        { "OA", Special::Up },
+        { "OB", Special::Down },
+        { "OC", Special::Right },
+        { "OD", Special::Left },
+        { "OH", Special::Home },
+        { "OF", Special::End },
+        { "[1~", Special::Home },
+        { "[3~", Special::Delete },
+        { "[4~", Special::End },
+        { "[7~", Special::Home },
+        { "[8~", Special::End },
+    };
 
-    for (;;)
+    bool find_escape_key(const char* sequence, size_t len, Special& special)
     {
-        if (read(STDIN_FILENO, &c, 1) < 1)
+        for (const auto& key : escape_keys)
         {
-            input.special = Input::Special::Eof;
-            m_pendingInputs.push_back(input);
-            return true;
+            if (strlen(key.sequence) == len && memcmp(key.sequence, sequence, len) == 0)
+            {
+                special = key.special;
+                return true;
+            }
         }
+        return false;
+    }
+}
 
-        buf.push_back(c);
+// Take the next key from the input buffer, and add it to the pending inputs (unless it's one
+// that's ignored). Returns false if the buffer ends partway through an escape sequence, so that
+// more has to be read first.
+bool Console_Posix::decode_input()
+{
+    if (m_pasting)
+    {
+        return decode_paste();
+    }
 
-        switch (c)
-        {
-        case '[':
-            break;
+    const char* p = m_inputBuffer + m_inputStart;
+    const char* end = m_inputBuffer + m_inputEnd;
 
-        case 'A':
-            input.special = Input::Special::Up;
-            goto direction_key;
-        case 'B':
-            input.special = Input::Special::Down;
-            goto direction_key;
-        case 'C':
-            input.special = Input::Special::Right;
-            goto direction_key;
-        case 'D':
-            input.special = Input::Special::Left;
-            goto direction_key;
-        
-        direction_key:
-            if (arg[0] == 0)
-                arg[0] = 1;
-            for (int i = 0; i < arg[0]; i++)
+    Input input = {};
+    input.type = Input::Type::Special;
+
+    if (*p != 27) // ASCII ESC
+    {
+        m_inputStart++;
+        for (const auto& key : control_keys)
+        {
+            if (*p == key.c)
             {
+                input.special = key.special;
                 m_pendingInputs.push_back(input);
+                return true;
             }
+        }
+
+        if (*p == 3) // ctrl-C
+        {
+            //TODO
+            //input.special = Input::Special::Kill;
+            ding();
             return true;
+        }
 
-        case ';':
-            arg_num++;
-            if (arg_num == countof(arg))
-            {
-                printf("too many arguments to CSI sequence\n");
-                return false;
-            }
-            break;
+        input.type = Input::Type::Character;
+        input.character = *p;
+        m_pendingInputs.push_back(input);
+        return true;
+    }
 
-        case '~':
-            switch (arg[0])
-            {
-            case 1:
-                input.special = Input::Special::Home;
-                break;
-            //case 2:
-            //    input.special = Input::Special::Insert;
-            //    break;
-            case 3:
-                input.special = Input::Special::Delete;
-                break;
-            case 4:
-                input.special = Input::Special::End;
-                break;
-            //case 5:
-            //    input.special = Input::Special::PageUp;
-            //    break;
-            //case 6:
-            //    input.special = Input::Special::PageDown;
-            //    break;
-            // 11-24: F keys
-            default:
-                ding();
-                return false;
-            }
-            m_pendingInputs.push_back(input);
-            return true;
+    if (end - p < 2)
+    {
+        return false;
+    }
+    else if (p[1] != '[' && p[1] != 'O')
+    {
+        // Not a sequence; just drop the ESC.
+        m_inputStart++;
+        return true;
+    }
 
-        default:
-            if (c >= '0' && c <= '9')
-            {
-                arg[arg_num] *= 10;
-                arg[arg_num] += (c - '0');
-            }
-            else
+    // The sequence ends with a character in the range @ to ~, after any parameters.
+    const char* last = p + 2;
+    while (last != end && !(*last >= '@' && *last <= '~'))
+    {
+        last++;
+    }
+    if (last == end)
+    {
+        return false;
+    }
+    m_inputStart = last + 1 - m_inputBuffer;
+
+    const char* sequence = p + 1;
+    size_t len = last + 1 - sequence;
+    const char shortSequence[2] = { p[1], *last };
+    if (len == 5 && memcmp(sequence, "[200~", len) == 0)
+    {
+        // The start of a paste.
+        m_pasting = true;
+        m_pasteAfterCR = false;
+    }
+    else if (find_escape_key(sequence, len, input.special)
+        || (*last != '~' && find_escape_key(shortSequence, 2, input.special)))
+    {
+        m_pendingInputs.push_back(input);
+    }
+    else
+    {
+        ding();
+    }
+    return true;
+}
+
+// Take pasted text from the input buffer, up to the marker at the end of the paste. It's added to
+// the pending inputs as blocks of text, split into lines as if Return had been pressed after each
+// one. Returns false if the marker hasn't been read yet.
+bool Console_Posix::decode_paste()
+{
+    static const char end_marker[] = "\033[201~";
+    const size_t marker_len = countof(end_marker) - 1;
+
+    const char* p = m_inputBuffer + m_inputStart;
+    const char* end = m_inputBuffer + m_inputEnd;
+    for (; p != end; p++)
+    {
+        const char c = *p;
+        if (c == 27)
+        {
+            const size_t left = end - p;
+            if (memcmp(p, end_marker, min(left, marker_len)) == 0)
             {
-                printf("bad escape: ");
-                for (size_t i = 0; i < buf.size(); i++)
+                if (left < marker_len)
                 {
-                    printf("%02x ", buf[i]);
+                    // It might be the start of the marker; wait for the rest.
+                    break;
                 }
-                printf("\n");
-                return false;
+
+                m_inputStart = p + marker_len - m_inputBuffer;
+                m_pasting = false;
+                push_paste_text();
+                return true;
             }
-            break;
         }
 
-        // TODO: handle VT100 escape codes for arrow keys
-        //input->type = Input::Type::Character;
-        //input->character = static_cast<char>(c);
-        //return true;
+        if (c == '\r' || c == '\n')
+        {
+            if (c == '\r' || !m_pasteAfterCR)
+            {
+                push_paste_text();
+                Input input = {};
+                input.type = Input::Type::Special;
+                input.special = Input::Special::Return;
+                m_pendingInputs.push_back(input);
+            }
+        }
+        else if (static_cast<unsigned char>(c) >= ' ' || c == '\t')
+        {
+            // Other control characters can't be shown in the line, so they're left out.
+            m_pasteText.push_back(c);
+        }
+        m_pasteAfterCR = (c == '\r');
     }
+
+    m_inputStart = p - m_inputBuffer;
+    return false;
 }
 
-Console::Input Console_Posix::get_input_char()
+void Console_Posix::push_paste_text()
 {
-    for (;;)
+    if (!m_pasteText.empty())
     {
         Input input = {};
+        input.type = Input::Type::Text;
+        input.text = move(m_pasteText);
+        m_pendingInputs.push_back(move(input));
+        m_pasteText.clear();
+    }
+}
+
+// Read whatever the terminal has, or wait until it has something. Returns false at the end of
+// the input.
+bool Console_Posix::read_input()
+{
+    if (m_inputStart == m_inputEnd)
+    {
+        m_inputStart = m_inputEnd = 0;
+    }
+    else if (m_inputStart != 0)
+    {
+        // Keep the start of an unfinished escape sequence.
+        memmove(m_inputBuffer, m_inputBuffer + m_inputStart, m_inputEnd - m_inputStart);
+        m_inputEnd -= m_inputStart;
+        m_inputStart = 0;
+    }
 
-        if (m_pendingInputs.size() > 0)
+    if (m_inputEnd == sizeof(m_inputBuffer))
+    {
+        // An escape sequence that never ends. Throw it away.
+        m_inputEnd = 0;
+    }
+
+    for (;;)
+    {
+        ssize_t num_read = read(STDIN_FILENO, m_inputBuffer + m_inputEnd, sizeof(m_inputBuffer) - m_inputEnd);
+        if (num_read > 0)
         {
-            input = m_pendingInputs.front();
-            m_pendingInputs.pop_front();
-            return input;
+            m_inputEnd += num_read;
+            return true;
+        }
+        else if (num_read < 0 && errno == EINTR)
+        {
+            continue;
         }
+        return false;
+    }
+}
 
-        char c;
-        ssize_t num_read = read(STDIN_FILENO, &c, 1);
-        if (num_read <= 0 || c == 4 /* ASCII EOT */)
+Console::Input Console_Posix::get_input_char()
+{
+    while (m_pendingInputs.empty())
+    {
+        if (m_inputStart != m_inputEnd && decode_input())
         {
+            continue;
+        }
+        else if (!m_pendingInputs.empty())
+        {
+            // Some of a paste, with the rest still to come.
+            break;
+        }
+
+        // Everything echoed for the keys so far goes out together, before waiting for more.
+        flush_output();
+
+        if (!read_input())
+        {
+            Input input = {};
             input.type = Input::Type::Special;
             input.special = Input::Special::Eof;
+            return input;
         }
-        else
+    }
+
+    Input input = m_pendingInputs.front();
+    m_pendingInputs.pop_front();
+    return input;
+}
+
+// Pastes are marked while a line is being edited, so that they can be told apart from typing.
+// Programs the shell runs get the terminal the way it was.
+void Console_Posix::begin_line()
+{
+    m_pending.append("\033[?2004h");
+}
+
+void Console_Posix::end_line()
+{
+    m_pending.append("\033[?2004l");
+}
+
+bool Console_Posix::input_pending()
+{
+    while (m_pendingInputs.empty() && m_inputStart != m_inputEnd)
+    {
+        if (!decode_input())
         {
-            //printf("got %d\n", c);
-            input.type = Input::Type::Special;
-            switch (c)
-            {
-            case '\r':
-            case '\n':
-                input.special = Input::Special::Return;
-                break;
-            case 27: // ASCII ESC
-                vt_escape();
-                continue;
-            case 127: // ASCII DEL
-                input.special = Input::Special::Backspace;
-                break;
-            case 3: // ctrl-C
-                //TODO
-                //input.special = Input::Special::Kill;
-                ding();
-                continue;
-            default:
-                input.type = Input::Type::Character;
-                input.character = static_cast<char>(c);
-            }
+            break;
         }
-        return input;
     }
+    return !m_pendingInputs.empty();
 }
 
-void SetColor(Console::CharAttr attrs)
+void Console_Posix::set_color(Console::CharAttr attrs)
 {
+    if (attrs == m_color)
+    {
+        return;
+    }
+    m_color = attrs;
+
     if (attrs == Console::CharAttr::Default)
-        return; // don't bother
+    {
+        m_pending.append("\033[0m");
+        return;
+    }
 
-    string code = "\033[3x;4x";
-    const size_t fgPos = 3;
-    const size_t bgPos = 6;
+    // Reset first, so nothing is left over from the last color.
+    string code = "\033[0;3x;4x";
+    const size_t fgPos = 5;
+    const size_t bgPos = 8;
 
     switch (static_cast<int>(attrs) & 0x7)
     {
@@ -300,45 +461,130 @@ void SetColor(Console::CharAttr attrs)
         code.append(";4");
 
     code.push_back('m');
-    write(STDOUT_FILENO, code.c_str(), code.size());
+    m_pending.append(code);
 }
 
-void ResetColor()
+// Move the cursor position along over text written to the terminal. Lines wrap at the edge of the
+// screen, and the screen scrolls once the cursor goes off the bottom.
+void Console_Posix::track_cursor(const char* s, size_t n)
 {
-    const char str[] = "\033[0m";
-    write(STDOUT_FILENO, str, countof(str) - 1);
+    Coord& cursor = m_details->cursor;
+    const char* end = s + n;
+    while (s != end)
+    {
+        const char* newline = static_cast<const char*>(memchr(s, '\n', end - s));
+        const char* stop = (newline != nullptr) ? newline : end;
+        IncrementWrap<int>(cursor.x, cursor.y, static_cast<int>(stop - s), m_details->screen.x);
+
+        if (newline != nullptr)
+        {
+            // The terminal makes it "\r\n".
+            cursor.x = 0;
+            cursor.y++;
+            stop++;
+        }
+        s = stop;
+    }
+
+    if (cursor.y >= m_details->screen.y)
+    {
+        cursor.y = m_details->screen.y - 1;
+    }
 }
 
 void Console_Posix::echo_char(char c, Console::CharAttr attrs)
 {
-    IncrementWrap<int>(m_details->cursor.x, m_details->cursor.y, 1, m_details->screen.x);
-    if (m_details->cursor.y == m_details->screen.y)
+    track_cursor(&c, 1);
+    set_color(attrs);
+    m_pending.push_back(c);
+}
+
+void Console_Posix::echo_string(const string& s, Console::CharAttr attrs)
+{
+    track_cursor(s.data(), s.size());
+    set_color(attrs);
+    m_pending.append(s);
+
+    if (m_pending.size() >= 64 * 1024)
     {
-        // We hit the bottom of the screen and scrolled.
-        m_details->cursor.y--;
+        flush_output();
     }
+}
 
-    SetColor(attrs);
-    ssize_t n = write(STDOUT_FILENO, &c, 1);
-    if (n != 1)
-        perror("echo_char write");
-    ResetColor();
+void Console_Posix::clear_to_end(size_t n)
+{
+    // Erase to the end of the row, or if the line wraps onto the rows below, the rest of the
+    // screen. Nothing comes after the input line.
+    if (m_details->cursor.x + n < static_cast<size_t>(m_details->screen.x))
+    {
+        m_pending.append("\033[K");
+    }
+    else
+    {
+        m_pending.append("\033[J");
+    }
 }
 
-void Console_Posix::echo_string(const string& s, Console::CharAttr attrs)
+// Inserting and deleting characters only moves the rest of the terminal's row, so the line can't
+// wrap.
+bool Console_Posix::insert_blanks(size_t n, size_t tail)
+{
+    if (tail == 0)
+    {
+        return true;
+    }
+    if (m_details->cursor.x + n + tail >= static_cast<size_t>(m_details->screen.x))
+    {
+        return false;
+    }
+
+    char str[32];
+    int num = snprintf(str, countof(str), "\033[%zu@", n);
+    m_pending.append(str, num);
+    return true;
+}
+
+bool Console_Posix::delete_chars(size_t n, size_t tail)
+{
+    if (m_details->cursor.x + n + tail >= static_cast<size_t>(m_details->screen.x))
+    {
+        return false;
+    }
+
+    char str[32];
+    int num = snprintf(str, countof(str), "\033[%zuP", n);
+    m_pending.append(str, num);
+    return true;
+}
+
+void Console_Posix::flush_output()
 {
-    IncrementWrap<int>(m_details->cursor.x, m_details->cursor.y, s.size(), m_details->screen.x);
-    SetColor(attrs);
-    ssize_t n = write(STDOUT_FILENO, s.c_str(), s.size());
-    if (n != static_cast<ssize_t>(s.size()))
-        perror("echo_string write");
-    ResetColor();
+    // Whatever writes to the terminal next should get its normal colors.
+    set_color(CharAttr::Default);
+
+    const char* p = m_pending.data();
+    size_t left = m_pending.size();
+    while (left > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, p, left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("console write");
+            break;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    m_pending.clear();
 }
 
 void Console_Posix::ding()
 {
-    char bell = '\a';
-    write(STDOUT_FILENO, &bell, 1);
+    m_pending.push_back('\a');
 }
 
 void Console_Posix::get_window_info()
@@ -42,22 +42,9 @@ BOOL WINAPI Console_Win32::ctrl_handler(DWORD dwCtrlType)
     switch (dwCtrlType)
     {
     case CTRL_C_EVENT:
-        {
-            int lineIdx = static_cast<int>(instance->m_currentInputLineIdx);
-            if (lineIdx == instance->m_inputLines.size() - 1)
-            {
-                // Current line is the last line -- hasn't been entered yet.
-                // Clear the current line.
-                instance->clear_current_display_line();
-                instance->m_inputLines[instance->m_currentInputLineIdx].clear();
-            }
-            else
-            {
-                // Current line is one previously entered.
-                // Switch to the empty line.
-                instance->new_empty_line();
-            }
-        }
+        // Throw away the line being typed, or the one recalled from the history, and start again
+        // with an empty one.
+        instance->new_empty_line();
         return TRUE;
     default:
         OutputDebugStringA("unhandled ctrl-sequence\n");
@@ -76,8 +63,6 @@ Console_Win32::Console_Win32()
 
     get_window_info();
 
-    m_currentInputLineIdx = 0;
-
     assert(s_pInstance == nullptr);
     s_pInstance = this;
 
@@ -199,6 +184,11 @@ void Console_Win32::write_output(const string& s, CharAttr attrs)
     echo_string(Widen(s), attrs);
 }
 
+void Console_Win32::flush_output()
+{
+    // Everything is written to the console as soon as it's given.
+}
+
 ostream& Console_Win32::ostream()
 {
     return m_ostream;
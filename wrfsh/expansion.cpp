@@ -0,0 +1,341 @@
+#include "unicodehack.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <map>
+#include <locale>
+#include <memory>
+#include <algorithm>
+#include <sstream>
+
+#include "common.h"
+#include "global_state.h"
+#include "commandlets.h"
+#include "repl.h"
+#include "expansion.h"
+#include "arithmetic.h"
+#include "script.h"
+#include "stream_ex.h"
+
+using namespace std;
+
+expansion::expansion(const string& expression) :
+    m_segments(),
+    m_hasBackticks(false),
+    m_hasArithmetic(false),
+    m_dynamic(false),
+    m_expression()
+{
+    if (!parse(expression))
+    {
+        m_segments.clear();
+        m_dynamic = true;
+        m_expression = expression;
+    }
+}
+
+// This follows the same rules as process_expression(), but instead of building the result, it
+// records where each piece of the result comes from.
+bool expansion::parse(const string& expression)
+{
+    string literal;
+    string varname;
+
+    auto flush_literal = [&]()
+    {
+        if (!literal.empty())
+        {
+            m_segments.push_back({ segment::kind::literal, move(literal), 0, 0, nullptr, nullptr });
+            literal.clear();
+        }
+    };
+
+    bool variable_pending = false;
+    size_t bt_substitution_start = 0;
+    vector<char> string_stack;
+    bool escape = false;
+    for (size_t i = 0, n = expression.size(); i <= n; i++)
+    {
+        const char c = expression[i];
+
+        if (variable_pending)
+        {
+            // See process_expression() for what these are.
+            static const string allowed_variable_special_characters = "#*@!_?$";
+
+            if (i == n
+                || (!isalnum(c, locale::classic())
+                    && (!varname.empty() || allowed_variable_special_characters.find(c) == string::npos)))
+            {
+                // A variable was ended.
+                size_t slot = global_state::intern_var(varname);
+                m_segments.push_back({ segment::kind::variable, string(), slot, 0, nullptr, nullptr });
+                varname.clear();
+                variable_pending = false;
+            }
+        }
+
+        if (i == n)
+        {
+            break;
+        }
+
+        if (escape)
+        {
+            goto normal;
+        }
+
+        switch (c)
+        {
+        case '"':
+            if (!string_stack.empty() && string_stack.back() == c)
+            {
+                string_stack.pop_back();
+            }
+            else if (string_stack.empty() || string_stack.back() != '\'')
+            {
+                string_stack.push_back(c);
+            }
+            break;
+
+        case '\'':
+            if (string_stack.empty())
+            {
+                string_stack.push_back('\'');
+            }
+            else if (string_stack.back() == '\'')
+            {
+                string_stack.pop_back();
+            }
+            else
+            {
+                goto normal;
+            }
+            break;
+
+        case '`':
+            if (!string_stack.empty() && string_stack.back() == '`')
+            {
+                flush_literal();
+
+                // The command line is everything since the opening backtick, which will be shifted up by one.
+                segment bt = { segment::kind::backtick, string(), 0, m_segments.size() + 1, nullptr, nullptr };
+
+                bool constant = true;
+                for (size_t j = bt_substitution_start; j < m_segments.size(); j++)
+                {
+                    if (m_segments[j].type != segment::kind::literal)
+                    {
+                        constant = false;
+                        break;
+                    }
+                    bt.text.append(m_segments[j].text);
+                }
+
+                if (constant)
+                {
+                    // The command line never changes, so compile it now instead of every time.
+                    bt.program = make_shared<script>();
+                    stringstream input(bt.text);
+                    script_parser parser(input);
+                    while (parser.parse_block(*bt.program, cerr))
+                    {
+                    }
+
+                    if (bt.program->open_block() != nullptr)
+                    {
+                        // Leave it to repl() to report the unfinished block when it's run.
+                        bt.program = nullptr;
+                    }
+                }
+                bt.text.clear();
+
+                m_segments.insert(m_segments.begin() + bt_substitution_start, move(bt));
+                m_hasBackticks = true;
+                string_stack.pop_back();
+            }
+            else if (string_stack.empty() || string_stack.back() != '\'')
+            {
+                if (find(string_stack.begin(), string_stack.end(), '`') != string_stack.end())
+                {
+                    // Nested backticks. process_expression() has some odd behavior with these;
+                    // leave it to that.
+                    return false;
+                }
+
+                string_stack.push_back('`');
+                flush_literal();
+                bt_substitution_start = m_segments.size();
+            }
+            else
+            {
+                goto normal;
+            }
+            break;
+
+        case '$':
+            if ((string_stack.empty() || string_stack.back() != '\'') && !variable_pending)
+            {
+                size_t end;
+                if (expression.compare(i, 3, "$((") == 0
+                    && (end = arithmetic::find_end(expression, i + 3)) != string::npos)
+                {
+                    auto math = make_shared<arithmetic>(expression.substr(i + 3, end - i - 3));
+                    long long value;
+                    if (math->is_constant(value))
+                    {
+                        literal.append(to_string(value));
+                    }
+                    else
+                    {
+                        flush_literal();
+                        m_segments.push_back({ segment::kind::arithmetic, string(), 0, 0, nullptr, move(math) });
+                        m_hasArithmetic = true;
+                    }
+                    i = end + 1;
+                    break;
+                }
+
+                flush_literal();
+                variable_pending = true;
+                break;
+            }
+            goto normal;
+
+        case '\\':
+            escape = true;
+            break;
+
+        normal:
+        default:
+            if (variable_pending)
+            {
+                varname.push_back(c);
+            }
+            else
+            {
+                literal.push_back(c);
+            }
+            escape = false;
+            break;
+        }
+    }
+
+    flush_literal();
+    return true;
+}
+
+bool expansion::is_variable(size_t& slot) const
+{
+    if (m_segments.size() == 1 && m_segments[0].type == segment::kind::variable)
+    {
+        slot = m_segments[0].slot;
+        return true;
+    }
+    return false;
+}
+
+string expansion::evaluate(global_state& global_state, istream& in, ostream& err) const
+{
+    if (m_dynamic)
+    {
+        return process_expression(m_expression, global_state, in, err);
+    }
+
+    return evaluate(0, m_segments.size(), global_state, in, err);
+}
+
+string expansion::evaluate(size_t begin, size_t end, global_state& global_state, istream& in, ostream& err) const
+{
+    if (end - begin == 1 && m_segments[begin].type == segment::kind::literal)
+    {
+        return m_segments[begin].text;
+    }
+    else if (end > begin && m_segments[begin].type == segment::kind::backtick && m_segments[begin].end == end)
+    {
+        // Nothing but a backtick command: its output is the result, without being copied.
+        return run_backtick(begin, global_state, in, err);
+    }
+
+    // Work out all the substitutions first, so the result can be put together with one allocation.
+    // Backticks can run commands that change variables, so if there are any, each variable's value
+    // has to be copied when it's looked up. Otherwise the values can just be referred to.
+    vector<string> copies;
+    copies.reserve((m_hasBackticks || m_hasArithmetic) ? end - begin : 0);
+
+    vector<const string*> values;
+    values.reserve(end - begin);
+
+    size_t total = 0;
+    for (size_t i = begin; i < end; i++)
+    {
+        const segment& seg = m_segments[i];
+        switch (seg.type)
+        {
+        case segment::kind::literal:
+            values.push_back(&seg.text);
+            break;
+
+        case segment::kind::variable:
+            if (m_hasBackticks)
+            {
+                copies.push_back(global_state.lookup_var(seg.slot));
+                values.push_back(&copies.back());
+            }
+            else
+            {
+                values.push_back(&global_state.lookup_var(seg.slot));
+            }
+            break;
+
+        case segment::kind::arithmetic:
+            copies.push_back(to_string(seg.math->evaluate(global_state, err)));
+            values.push_back(&copies.back());
+            break;
+
+        case segment::kind::backtick:
+            copies.push_back(run_backtick(i, global_state, in, err));
+            values.push_back(&copies.back());
+            i = seg.end - 1;
+            break;
+        }
+        total += values.back()->size();
+    }
+
+    string result;
+    result.reserve(total);
+    for (const string* value : values)
+    {
+        result.append(*value);
+    }
+
+    return result;
+}
+
+string expansion::run_backtick(size_t index, global_state& global_state, istream& in, ostream& err) const
+{
+    const segment& bt = m_segments[index];
+
+    capture_buf buffer;
+    ostream output(&buffer);
+    int exitCode;
+
+    if (bt.program != nullptr)
+    {
+        exitCode = bt.program->run(in, output, err, global_state);
+    }
+    else
+    {
+        stringstream input(evaluate(index + 1, bt.end, global_state, in, err));
+        exitCode = repl(input, output, err, global_state, in);
+    }
+
+    global_state.let(global_state::status_slot, to_string(exitCode));
+
+    string captured = buffer.take();
+    strip_trailing_newlines(captured);
+    return captured;
+}
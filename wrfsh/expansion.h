@@ -0,0 +1,52 @@
+#pragma once
+
+class global_state;
+class script;
+class arithmetic;
+
+// An argument split up, once, into the pieces process_expression() would turn it into: literal
+// text (with quotes and escapes already removed), variable references, $(( )) arithmetic, and
+// backtick substitutions. Evaluating it just looks up the variables, does the arithmetic, runs the
+// backticks, and joins the pieces together.
+class expansion
+{
+public:
+    expansion(const std::string& expression);
+
+    std::string evaluate(global_state& global_state, std::istream& in, std::ostream& err) const;
+
+    // True if the whole expression is just one variable, and which one.
+    bool is_variable(size_t& slot) const;
+
+private:
+    struct segment
+    {
+        enum class kind
+        {
+            literal,
+            variable,
+            arithmetic,
+            backtick,
+        };
+
+        kind type;
+        std::string text;               // Literal text.
+        size_t slot;                    // For variables: the variable's slot.
+        size_t end;                     // For backticks: the command line is segments (this, end).
+        std::shared_ptr<script> program;// For backticks with a constant command line: the compiled command.
+        std::shared_ptr<::arithmetic> math;   // For arithmetic: the parsed expression.
+    };
+
+    bool parse(const std::string& expression);
+    std::string evaluate(size_t begin, size_t end, global_state& global_state, std::istream& in, std::ostream& err) const;
+    std::string run_backtick(size_t index, global_state& global_state, std::istream& in, std::ostream& err) const;
+
+    std::vector<segment> m_segments;
+    bool m_hasBackticks;
+    bool m_hasArithmetic;
+
+    // Set if the expression couldn't be split up (nested backticks), in which case it gets handed
+    // to process_expression() every time.
+    bool m_dynamic;
+    std::string m_expression;
+};
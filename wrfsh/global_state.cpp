@@ -3,7 +3,11 @@
 #include <vector>
 #include <unordered_map>
 #include <list>
+#include <map>
+#include <deque>
+#include <memory>
 #include <sstream>
+#include <mutex>
 
 #include "common.h"
 #include "process.h"
@@ -11,6 +15,65 @@
 
 using namespace std;
 
+namespace
+{
+    // Shared by every global_state, including the copies used by commandlets running in a
+    // pipeline, so it's locked.
+    struct symbol_table
+    {
+        unordered_map<string, size_t> slots;
+        deque<string> names;
+        mutex lock;
+
+        symbol_table()
+        {
+            // These have to match the *_slot constants in global_state.
+            add("*");
+            add("$");
+            add("?");
+            add("PATH");
+        }
+
+        size_t add(const string& name)
+        {
+            lock_guard<mutex> guard(lock);
+            auto pos = slots.insert({ name, names.size() });
+            if (pos.second)
+            {
+                names.push_back(name);
+            }
+            return pos.first->second;
+        }
+
+        bool find(const string& name, size_t& slot)
+        {
+            lock_guard<mutex> guard(lock);
+            auto pos = slots.find(name);
+            if (pos == slots.end())
+            {
+                return false;
+            }
+            slot = pos->second;
+            return true;
+        }
+
+        const string& name(size_t slot)
+        {
+            // Names are never removed, and adding to a deque doesn't move the others.
+            lock_guard<mutex> guard(lock);
+            return names[slot];
+        }
+    };
+
+    symbol_table& symbols()
+    {
+        static symbol_table table;
+        return table;
+    }
+
+    const string s_empty;
+}
+
 global_state::global_state(int argc, const char * const argv [], const char * const env []) :
     interactive(false),
     error(false),
@@ -25,6 +88,12 @@ global_state::global_state(int argc, const char * const argv [], const char * co
     let("?", "0");
     let("PWD", get_current_working_directory(cerr));
 
+#ifdef _MSC_VER
+    m_pid = to_string(GetCurrentProcessId());
+#else
+    m_pid = to_string(getpid());
+#endif
+
     for (size_t i = 0; env[i] != nullptr; i++)
     {
         string key, value;
@@ -44,10 +113,19 @@ global_state::global_state(int argc, const char * const argv [], const char * co
                 value.push_back(env[i][j]);
             }
         }
-        environment.emplace(key, value);
+        size_t slot = intern_var(key);
+        if (slot >= variables.size())
+        {
+            variables.resize(slot + 1);
+        }
+        if (!variables[slot].has_environment)
+        {
+            variables[slot].environment = move(value);
+            variables[slot].has_environment = true;
+        }
     }
 
-    if (environment.find("HOST") == environment.end())
+    if (lookup_var("HOST").empty())
     {
         vector<string> empty_args;
         Process hostname_process("hostname", empty_args);
@@ -77,57 +155,128 @@ global_state::global_state(int argc, const char * const argv [], const char * co
     user.append(lookup_var("USERNAME"));
     let("USER", user);
 
-    let("HOME", environment["HOMEDRIVE"] + environment["HOMEPATH"]);
+    let("HOME", lookup_var("HOMEDRIVE") + lookup_var("HOMEPATH"));
 #endif
 }
 
-std::string global_state::lookup_var(string key)
+size_t global_state::intern_var(const string& key)
+{
+    return symbols().add(key);
+}
+
+const string& global_state::var_name(size_t slot)
+{
+    return symbols().name(slot);
+}
+
+const string& global_state::lookup_var(size_t slot)
 {
     // Special variables:
-    if (key == "*")
+    if (slot == all_args_slot)
     {
-        string result;
+        m_allArgs.clear();
 
-        int n = atoi(local_vars["#"].c_str());
+        int n = atoi(lookup_var("#").c_str());
         for (int i = 0; i < n; i++)
         {
-            result += ((i != 0) ? " " : "") + local_vars[to_string(i+1)];
+            if (i != 0)
+            {
+                m_allArgs.push_back(' ');
+            }
+            m_allArgs.append(lookup_var(to_string(i + 1)));
         }
 
-        return result;
+        return m_allArgs;
     }
-    else if (key == "$")
+    else if (slot == pid_slot)
     {
-#ifdef _MSC_VER
-        return to_string(GetCurrentProcessId());
-#else
-        return to_string(getpid());
-#endif
+        return m_pid;
+    }
+
+    if (slot < variables.size())
+    {
+        const variable& var = variables[slot];
+        if (var.has_local)
+        {
+            return var.local;
+        }
+        if (var.has_environment)
+        {
+            return var.environment;
+        }
+    }
+    return s_empty;
+}
+
+void global_state::let(size_t slot, string value)
+{
+    if (slot >= variables.size())
+    {
+        variables.resize(slot + 1);
+    }
+
+    variables[slot].local = move(value);
+    variables[slot].has_local = true;
+    variables[slot].has_number = false;
+
+    if (slot == path_slot)
+    {
+        command_paths.clear();
+    }
+}
+
+bool global_state::find_command(const string& name, string& path)
+{
+    auto pos = command_paths.find(name);
+    if (pos != command_paths.end())
+    {
+        path = pos->second;
+        return !path.empty();
     }
 
-    auto pos = local_vars.find(key);
-    if (pos != local_vars.end())
+    bool cacheable;
+    bool found = Process::Find(name, lookup_var(path_slot), path, cacheable);
+    if (cacheable)
     {
-        return pos->second;
+        command_paths[name] = found ? path : string();
     }
-    pos = environment.find(key);
-    if (pos != environment.end())
+    return found;
+}
+
+long long global_state::lookup_number(size_t slot)
+{
+    if (slot < variables.size() && slot != all_args_slot && slot != pid_slot)
     {
-        return pos->second;
+        variable& var = variables[slot];
+        if (!var.has_number)
+        {
+            var.number = to_number(lookup_var(slot));
+            var.has_number = true;
+        }
+        return var.number;
     }
-    return "";
+    return to_number(lookup_var(slot));
+}
+
+void global_state::let_number(size_t slot, long long value)
+{
+    let(slot, to_string(value));
+    variables[slot].number = value;
+    variables[slot].has_number = true;
 }
 
-void global_state::let(string key, string value)
+const string& global_state::lookup_var(const string& key)
 {
-    auto pos = local_vars.insert({ key, value });
-    if (!pos.second)
+    size_t slot;
+    if (!symbols().find(key, slot))
     {
-        pos.first->second = value;
+        // Never interned, so it can't have been set.
+        return s_empty;
     }
+    return lookup_var(slot);
 }
 
-int global_state::program_line_comp(global_state::program_line& a, global_state::program_line& b)
+void global_state::let(const string& key, string value)
 {
-    return atoi(a.number.c_str()) < atoi(b.number.c_str());
+    let(intern_var(key), move(value));
 }
@@ -1,44 +1,89 @@
 #pragma once
 
+class script;
+class Process;
+
 class global_state
 {
 public:
     bool interactive;
     bool error;
     bool exit;
-    std::unordered_map<std::string, std::string> environment;
-    std::unordered_map<std::string, std::string> local_vars;
 
+    // Variables are stored by slot number. Names are interned into slots once (usually when a
+    // script is compiled), and the slot numbers are the same for every global_state.
+    //
+    // Each variable also remembers its value as a number, once it has been used as one, so that
+    // arithmetic and comparisons don't have to parse the text every time.
+    struct variable
+    {
+        std::string local;
+        std::string environment;
+        long long number;
+        bool has_local;
+        bool has_environment;
+        bool has_number;
+    };
+    std::vector<variable> variables;
+
+    // Slots that are always interned first.
+    static const size_t all_args_slot = 0;  // $*
+    static const size_t pid_slot = 1;       // $$
+    static const size_t status_slot = 2;    // $?
+    static const size_t path_slot = 3;      // $PATH
+
+    // Where external commands were found on the PATH, by name. An empty path means the command
+    // wasn't found. This is cleared whenever PATH is set.
+    std::unordered_map<std::string, std::string> command_paths;
+
+    // The stored program, by line number. Each line is kept split into its command and
+    // (unexpanded) arguments.
     struct program_line
     {
-        std::string number;
         std::string command;
         std::vector<std::string> args;
-
-        program_line(std::string number, std::string command, std::vector<std::string> args) :
-            number(number),
-            command(command),
-            args(args)
-        {}
-
-        program_line() :
-            number(""),
-            command(""),
-            args()
-        {}
     };
-    std::list<program_line> stored_program;
+    std::map<int, program_line> stored_program;
+
+    // The stored program compiled into a script, or null if it has been changed since it was last
+    // run.
+    std::shared_ptr<script> stored_program_script;
 
-    struct if_state_vars
+    // Pipelines running in the background ('cmd &'), oldest first. Each is removed once it's been
+    // seen to finish.
+    struct job
     {
-        bool active;
-        bool chain_matched; // for a chain of if-elseif-elseif-else, has any 'if' evaluated to true?
+        int number;                     // As shown by 'jobs', and for 'wait %n'.
+        std::string command;
+        std::vector<std::shared_ptr<Process>> processes;
     };
-    std::vector<if_state_vars> if_state;
+    std::vector<job> jobs;
+
+    // In an interactive session, a loop that has been started but not yet closed. Lines are
+    // added to it until it is, and then it runs.
+    std::shared_ptr<script> pending_script;
 
     global_state(int argc, const char * const argv [], const char * const env []);
-    std::string lookup_var(std::string key);
-    void let(std::string key, std::string value);
 
-    static int program_line_comp(program_line& a, program_line& b);
+    static size_t intern_var(const std::string& key);
+    static const std::string& var_name(size_t slot);
+
+    const std::string& lookup_var(size_t slot);
+    void let(size_t slot, std::string value);
+
+    // Find an external command, using command_paths if it has been looked up before. Returns
+    // false if it isn't found.
+    bool find_command(const std::string& name, std::string& path);
+
+    // A variable's value as a number, and setting a variable to a number.
+    long long lookup_number(size_t slot);
+    void let_number(size_t slot, long long value);
+
+    // Look up or set a variable by name. Compiled scripts use the slot versions instead.
+    const std::string& lookup_var(const std::string& key);
+    void let(const std::string& key, std::string value);
+
+private:
+    std::string m_pid;
+    std::string m_allArgs;
 };
@@ -0,0 +1,224 @@
+#include "unicodehack.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "history.h"
+
+using namespace std;
+
+namespace
+{
+    // Which of a signature's 64 bits each three-character sequence in the text sets.
+    uint64_t signature(const char* text, size_t size)
+    {
+        uint64_t bits = 0;
+        for (size_t i = 0; i + 3 <= size; i++)
+        {
+            const uint32_t key = (static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16)
+                | (static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8)
+                | static_cast<unsigned char>(text[i + 2]);
+            bits |= static_cast<uint64_t>(1) << ((key * 2654435761u) >> 26);
+        }
+        return bits;
+    }
+}
+
+History::History(size_t capacity) :
+    m_capacity(capacity),
+    m_recent(),
+    m_fd(-1),
+    m_map(nullptr),
+    m_mapLength(0),
+    m_mapSize(0),
+    m_added(),
+    m_indexed(false),
+    m_entries(),
+    m_signatures()
+{
+}
+
+History::~History()
+{
+#ifndef _MSC_VER
+    if (m_map != nullptr)
+    {
+        munmap(const_cast<char*>(m_map), m_mapLength);
+    }
+    if (m_fd != -1)
+    {
+        close(m_fd);
+    }
+#endif
+}
+
+void History::open(const string& path)
+{
+#ifndef _MSC_VER
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (m_fd == -1)
+    {
+        return;
+    }
+
+    struct stat info;
+    if (fstat(m_fd, &info) != 0 || info.st_size == 0)
+    {
+        return;
+    }
+
+    void* map = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    m_map = static_cast<const char*>(map);
+    m_mapLength = static_cast<size_t>(info.st_size);
+
+    // Another session could be partway through adding a line at the end.
+    const void* last = memrchr(m_map, '\n', m_mapLength);
+    m_mapSize = (last == nullptr) ? 0 : static_cast<const char*>(last) + 1 - m_map;
+
+    // Go back from the end until there are enough different lines for Up and Down. The rest of
+    // the file isn't looked at until there's a search.
+    vector<string> recent;
+    unordered_set<string> seen;
+    const char* end = m_map + m_mapSize;
+    while (end != m_map && recent.size() < m_capacity)
+    {
+        const char* lineEnd = end - 1;
+        const void* previous = memrchr(m_map, '\n', lineEnd - m_map);
+        const char* lineStart = (previous == nullptr) ? m_map : static_cast<const char*>(previous) + 1;
+
+        string line(lineStart, lineEnd);
+        if (!line.empty() && seen.insert(line).second)
+        {
+            recent.push_back(move(line));
+        }
+        end = lineStart;
+    }
+    m_recent.assign(make_move_iterator(recent.rbegin()), make_move_iterator(recent.rend()));
+#else
+    // Only kept for the session on Windows.
+    (void)path;
+#endif
+}
+
+void History::add(const string& line)
+{
+    if (line.empty())
+    {
+        return;
+    }
+
+#ifndef _MSC_VER
+    if (m_fd != -1)
+    {
+        // All in one write, so that it can't be mixed up with lines from other sessions.
+        string record = line + '\n';
+        if (write(m_fd, record.data(), record.size()) != static_cast<ssize_t>(record.size()))
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+#endif
+
+    m_added.push_back(line);
+    add_recent(line);
+
+    if (m_indexed)
+    {
+        add_entry(m_added.back().data(), m_added.back().size());
+    }
+}
+
+// Add a line to the recent ones, taking out any earlier copy of it.
+void History::add_recent(const string& line)
+{
+    auto pos = find(m_recent.begin(), m_recent.end(), line);
+    if (pos != m_recent.end())
+    {
+        m_recent.erase(pos);
+    }
+
+    m_recent.push_back(line);
+    if (m_recent.size() > m_capacity)
+    {
+        m_recent.pop_front();
+    }
+}
+
+size_t History::size() const
+{
+    return m_recent.size();
+}
+
+const string& History::operator[](size_t index) const
+{
+    return m_recent[index];
+}
+
+bool History::search(
+    const string& text,
+    const unordered_set<string>& skip,
+    size_t& position,
+    string& line
+    )
+{
+    if (!m_indexed)
+    {
+        build_index();
+    }
+
+    const uint64_t wanted = signature(text.data(), text.size());
+    for (size_t i = min(position, m_entries.size()); i-- > 0; )
+    {
+        const span& entry = m_entries[i];
+        if ((m_signatures[i] & wanted) == wanted
+            && std::search(entry.data, entry.data + entry.size, text.begin(), text.end()) != entry.data + entry.size)
+        {
+            string found(entry.data, entry.size);
+            if (skip.find(found) == skip.end())
+            {
+                position = i;
+                line = move(found);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void History::build_index()
+{
+    for (const char* p = m_map, *end = m_map + m_mapSize; p != end; )
+    {
+        const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+        add_entry(p, newline - p);
+        p = newline + 1;
+    }
+    for (const string& line : m_added)
+    {
+        add_entry(line.data(), line.size());
+    }
+    m_indexed = true;
+}
+
+void History::add_entry(const char* data, size_t size)
+{
+    m_entries.push_back({ data, size });
+    m_signatures.push_back(signature(data, size));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Lines entered at the console. Each one is appended to a file as it's entered, so the history is
+// kept between sessions, and any number of sessions can share the file: each line goes in with a
+// single write, and a session only ever reads the complete lines that were there when it started.
+//
+// The file is mapped into memory rather than read. Only the most recent lines are kept in memory
+// for going back through with Up and Down, with repeats taken out. Searching goes through the
+// whole file, using an index of the three-character sequences in each line, which is made the
+// first time there's a search.
+class History
+{
+public:
+    History(size_t capacity);
+    ~History();
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    // Use the history kept in the given file, creating it if it isn't there. Without one, the
+    // history only lasts as long as the session.
+    void open(const std::string& path);
+
+    void add(const std::string& line);
+
+    // The most recent lines, oldest first.
+    size_t size() const;
+    const std::string& operator[](size_t index) const;
+
+    // Search every line, from the file and this session, for text. Lines are numbered from 0 (the
+    // oldest in the file) up. Finds the newest one numbered below 'position' (from_newest to
+    // start with) that isn't one of the lines in skip, and sets position to its number. Returns
+    // false if there isn't one.
+    static const size_t from_newest = static_cast<size_t>(-1);
+    bool search(
+        const std::string& text,
+        const std::unordered_set<std::string>& skip,
+        size_t& position,
+        std::string& line
+        );
+
+private:
+    struct span
+    {
+        const char* data;
+        size_t size;
+    };
+
+    void add_recent(const std::string& line);
+    void build_index();
+    void add_entry(const char* data, size_t size);
+
+    size_t m_capacity;
+    std::deque<std::string> m_recent;
+
+    int m_fd;
+    const char* m_map;                  // The file, as it was when it was opened.
+    size_t m_mapLength;
+    size_t m_mapSize;                   // How much of it is complete lines.
+    std::deque<std::string> m_added;    // Lines added since then.
+
+    // The search index: where each line is, and which three-character sequences it has, hashed
+    // into the bits of a signature. A line can only have the text searched for if its signature
+    // has all of the text's bits.
+    bool m_indexed;
+    std::vector<span> m_entries;
+    std::vector<uint64_t> m_signatures;
+};
@@ -1,147 +1,233 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <map>
 #include <unordered_map>
 #include <string>
 #include <memory>
 #include <algorithm>
 #include <functional>
 #include <regex>
+#include <array>
+#include <bitset>
 
 #include "common.h"
 #include "global_state.h"
 #include "commandlets.h"
-#include "repl.h"
+#include "expansion.h"
+#include "if_expression.h"
+#include "pattern.h"
 
 using namespace std;
 
 namespace IfExpression
 {
-    struct Comparison
+    void Operand::set(const string& s)
     {
-        string expression1;
-        string op;
-        string expression2;
-    };
+        text = s;
+        if (s.find_first_of("\"'`$\\") == string::npos)
+        {
+            number = to_number(s);
+            expanded = nullptr;
+        }
+        else
+        {
+            expanded = make_unique<expansion>(s);
+            is_variable = expanded->is_variable(slot);
+        }
+    }
 
-    struct Expression;
-    struct CompoundExpression
+    const string& Operand::evaluate(string& storage, global_state& state, istream& in, ostream& err) const
     {
-        unique_ptr<Expression> expr1;
-        string op;
-        unique_ptr<Expression> expr2;
-    };
+        if (expanded == nullptr)
+        {
+            return text;
+        }
 
-    struct Expression
+        storage = expanded->evaluate(state, in, err);
+        return storage;
+    }
+
+    long long Operand::evaluate_number(global_state& state, istream& in, ostream& err) const
     {
-        enum class Type { Empty, Comparison, CompoundExpression };
-        Type type;
-        unique_ptr<Comparison> comparison;
-        unique_ptr<CompoundExpression> compound_expression;
+        if (expanded == nullptr)
+        {
+            return number;
+        }
+        else if (is_variable)
+        {
+            return state.lookup_number(slot);
+        }
 
-        Expression() : type(Type::Empty)
-        {}
+        return to_number(expanded->evaluate(state, in, err));
+    }
 
-        bool evaluate(istream& in, ostream& out, ostream& err, global_state& state)
+    bool Expression::evaluate(istream& in, ostream& out, ostream& err, global_state& state)
+    {
+        if (type == Type::CompoundExpression)
         {
-            if (type == Type::CompoundExpression)
+            bool left = compound_expression->expr1->evaluate(in, out, err, state);
+            if (state.error)
+            {
+                return false;
+            }
+
+            if (compound_expression->op == Logic::None)
             {
-                bool left = compound_expression->expr1->evaluate(in, out, err, state);
+                return left;
+            }
+            else if ((compound_expression->op == Logic::And && left) || (compound_expression->op == Logic::Or && !left))
+            {
+                bool right = compound_expression->expr2->evaluate(in, out, err, state);
                 if (state.error)
                 {
                     return false;
                 }
 
-                if (compound_expression->op == "")
-                {
-                    return left;
-                }
-                else if ((compound_expression->op == "&&" && left) || (compound_expression->op == "||" && !left))
-                {
-                    bool right = compound_expression->expr2->evaluate(in, out, err, state);
-                    if (state.error)
-                    {
-                        return false;
-                    }
-
-                    return right;
-                }
-                else
-                {
-                    return left;
-                }
+                return right;
             }
-            else if (type == Type::Comparison)
+            else
             {
-                string& op = comparison->op;
+                return left;
+            }
+        }
+        else if (type == Type::Comparison)
+        {
+            Comparison& c = *comparison;
 
-                string left = process_expression(comparison->expression1, state, in, err);
+            if (c.op == Operator::None
+                || (c.op >= Operator::Less && c.op <= Operator::GreaterEqual))
+            {
+                long long left = c.expression1.evaluate_number(state, in, err);
                 if (state.error)
                 {
                     return false;
                 }
 
-                if (op.empty())
+                if (c.op == Operator::None)
                 {
-                    return atoi(left.c_str()) != 0;
+                    return left != 0;
                 }
 
-                string right = process_expression(comparison->expression2, state, in, err);
+                long long right = c.expression2.evaluate_number(state, in, err);
                 if (state.error)
                 {
                     return false;
                 }
 
-                if (op == "==")
+                switch (c.op)
                 {
-                    return left == right;
+                case Operator::Less:
+                    return left < right;
+                case Operator::LessEqual:
+                    return left <= right;
+                case Operator::Greater:
+                    return left > right;
+                default:
+                    return left >= right;
                 }
-                else if (op == "!=")
-                {
-                    return left != right;
-                }
-                else if (op == "<")
-                {
-                    return atoi(left.c_str()) < atoi(right.c_str());
-                }
-                else if (op == "<=")
-                {
-                    return atoi(left.c_str()) <= atoi(right.c_str());
-                }
-                else if (op == ">")
-                {
-                    return atoi(left.c_str()) > atoi(right.c_str());
-                }
-                else if (op == ">=")
-                {
-                    return atoi(left.c_str()) >= atoi(right.c_str());
-                }
-                else if (op == "~")
-                {
-                    regex r(right);
-                    return regex_match(left, r);
-                }
-                else if (op == "!~")
-                {
-                    regex r(right);
-                    return !regex_match(left, r);
-                }
-                else
+            }
+
+            string left_storage;
+            const string& left = c.expression1.evaluate(left_storage, state, in, err);
+            if (state.error)
+            {
+                return false;
+            }
+
+            string right_storage;
+            const string& right = c.expression2.evaluate(right_storage, state, in, err);
+            if (state.error)
+            {
+                return false;
+            }
+
+            switch (c.op)
+            {
+            case Operator::Equal:
+                return left == right;
+            case Operator::NotEqual:
+                return left != right;
+            case Operator::Match:
+            case Operator::NotMatch:
+            {
+                // A constant pattern is compiled the first time it's used, not when it's parsed, so
+                // a bad pattern is only an error if it's actually reached.
+                shared_ptr<pattern> p = c.compiled;
+                if (p == nullptr)
                 {
-                    err << "invalid operand in if statement: \"" << op << "\"\n";
-                    state.error = true;
-                    return false;
+                    p = pattern::get(right);
+                    if (c.expression2.expanded == nullptr)
+                    {
+                        c.compiled = p;
+                    }
                 }
+                return p->matches(left) == (c.op == Operator::Match);
             }
-            else
-            {
-                err << "expression type cannot be empty! this is a bug.\n";
+            default:
+                err << "invalid operand in if statement\n";
                 state.error = true;
                 return false;
             }
         }
+        else
+        {
+            err << "expression type cannot be empty! this is a bug.\n";
+            state.error = true;
+            return false;
+        }
+    }
+
+    const struct
+    {
+        const char* text;
+        Operator op;
+    } operators[] =
+    {
+        { "==", Operator::Equal },
+        { "!=", Operator::NotEqual },
+        { "<", Operator::Less },
+        { "<=", Operator::LessEqual },
+        { ">", Operator::Greater },
+        { ">=", Operator::GreaterEqual },
+        { "~", Operator::Match },
+        { "!~", Operator::NotMatch },
     };
 
+    const struct
+    {
+        const char* text;
+        Logic op;
+    } logic_operators[] =
+    {
+        { "&&", Logic::And },
+        { "||", Logic::Or },
+    };
+
+    const char* operator_text(Operator op)
+    {
+        for (const auto& o : operators)
+        {
+            if (o.op == op)
+            {
+                return o.text;
+            }
+        }
+        return "";
+    }
+
+    const char* logic_text(Logic op)
+    {
+        for (const auto& o : logic_operators)
+        {
+            if (o.op == op)
+            {
+                return o.text;
+            }
+        }
+        return "";
+    }
+
     void print_ast(ostream& out, Expression& exp, int nesting_level)
     {
         out << string(nesting_level * 4, ' ')
@@ -153,9 +239,9 @@ namespace IfExpression
         else if (exp.type == Expression::Type::Comparison)
         {
             out << "comparison:\n";
-            out << string((nesting_level + 1) * 4, ' ') << exp.comparison->expression1 << endl;
-            out << string((nesting_level + 1) * 4, ' ') << exp.comparison->op << endl;
-            out << string((nesting_level + 1) * 4, ' ') << exp.comparison->expression2 << endl;
+            out << string((nesting_level + 1) * 4, ' ') << exp.comparison->expression1.text << endl;
+            out << string((nesting_level + 1) * 4, ' ') << operator_text(exp.comparison->op) << endl;
+            out << string((nesting_level + 1) * 4, ' ') << exp.comparison->expression2.text << endl;
         }
         else if (exp.type == Expression::Type::CompoundExpression)
         {
@@ -170,7 +256,7 @@ namespace IfExpression
                 print_ast(out, *e1, nesting_level + 1);
             }
 
-            out << string((nesting_level + 1) * 4, ' ') << exp.compound_expression->op << endl;
+            out << string((nesting_level + 1) * 4, ' ') << logic_text(exp.compound_expression->op) << endl;
 
             auto e2 = exp.compound_expression->expr2.get();
             if (e2 == nullptr)
@@ -202,8 +288,31 @@ namespace IfExpression
         // logic_operator = "&&" | "||" ;
         // variable_name = [a-zA-Z0-9]*
 
-        const vector<string> operators({ "==", "!=", "<", "<=", ">", ">=", "~", "!~" });
-        const vector<string> logic_operators({ "&&", "||" });
+        auto find_operator = [](const string& arg, Operator& op)
+        {
+            for (const auto& o : operators)
+            {
+                if (arg == o.text)
+                {
+                    op = o.op;
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        auto find_logic_operator = [](const string& arg, Logic& op)
+        {
+            for (const auto& o : logic_operators)
+            {
+                if (arg == o.text)
+                {
+                    op = o.op;
+                    return true;
+                }
+            }
+            return false;
+        };
 
         enum class State
         {
@@ -212,10 +321,11 @@ namespace IfExpression
         State s = State::Expression1;
 
         vector<Expression*> stack({ &root_expression });
+        Logic logic;
 
         for (size_t i = 0, n = args.size(); i < n; i++)
         {
-            string arg = args[i];
+            const string& arg = args[i];
 
             // DEBUG: print the AST at each iteration
             //out << i << " ===========================================\n";
@@ -272,7 +382,7 @@ namespace IfExpression
                     stack.back()->comparison = make_unique<Comparison>();
                     if (arg != "(")
                     {
-                        stack.back()->comparison->expression1 = arg;
+                        stack.back()->comparison->expression1.set(arg);
                         s = State::Comparison1;
                     }
                 }
@@ -280,9 +390,8 @@ namespace IfExpression
 
             case State::Comparison1:
 
-                if (find(operators.begin(), operators.end(), arg) != operators.end())
+                if (find_operator(arg, stack.back()->comparison->op))
                 {
-                    stack.back()->comparison->op = arg;
                     s = State::Comparison2;
                 }
                 else
@@ -294,7 +403,7 @@ namespace IfExpression
 
             case State::Comparison2:
 
-                stack.back()->comparison->expression2 = arg;
+                stack.back()->comparison->expression2.set(arg);
                 s = State::Expression2;
                 break;
 
@@ -318,7 +427,7 @@ namespace IfExpression
                         }
                     }
                 }
-                else if (find(logic_operators.begin(), logic_operators.end(), arg) != logic_operators.end())
+                else if (find_logic_operator(arg, logic))
                 {
                     if (stack.back()->type == Expression::Type::Comparison)
                     {
@@ -327,14 +436,14 @@ namespace IfExpression
                         stack.back()->compound_expression->expr1 = make_unique<Expression>();
                         stack.back()->compound_expression->expr1->type = Expression::Type::Comparison;
                         stack.back()->compound_expression->expr1->comparison.swap(stack.back()->comparison);
-                        stack.back()->compound_expression->op = arg;
+                        stack.back()->compound_expression->op = logic;
                         stack.back()->compound_expression->expr2 = make_unique<Expression>();
                         stack.push_back(stack.back()->compound_expression->expr2.get());
                         s = State::Expression1;
                     }
                     else if (stack.back()->type == Expression::Type::CompoundExpression)
                     {
-                        stack.back()->compound_expression->op = arg;
+                        stack.back()->compound_expression->op = logic;
                         stack.back()->compound_expression->expr2 = make_unique<Expression>();
                         stack.push_back(stack.back()->compound_expression->expr2.get());
                         s = State::Expression1;
@@ -352,99 +461,3 @@ namespace IfExpression
         return true;
     }
 }
-
-int if_commandlet(istream& in, ostream& out, ostream& err, global_state& global_state, vector<string>& args)
-{
-    IfExpression::Expression root_expression;
-
-    bool successful_parse = IfExpression::parse_if_expression(args, root_expression, err);
-
-    if (!successful_parse)
-    {
-        global_state.error = true;
-        return -1;
-    }
-
-    //DEBUG print AST
-    //IfExpression::print_ast(out, root_expression, 0);
-
-    bool if_result = root_expression.evaluate(in, out, err, global_state);
-    if (global_state.error)
-    {
-        return -1;
-    }
-
-    global_state.if_state.push_back({ if_result, if_result });
-
-    return 0;
-}
-
-int else_commandlet(istream& in, ostream& out, ostream& err, global_state& state, vector<string>& args)
-{
-    if (state.if_state.size() == 0)
-    {
-        err << "Syntax error: else without preceding if\n";
-        state.error = true;
-        return -1;
-    }
-
-    if (args.size() > 0)
-    {
-        if (args[0] == "if")
-        {
-            if (!state.if_state.back().active && !state.if_state.back().chain_matched)
-            {
-                vector<string> args2(args.begin() + 1, args.end());
-                if_commandlet(in, out, err, state, args2);
-                bool condition = state.if_state.back().active;
-                state.if_state.pop_back();
-                state.if_state.back().active = condition;
-                state.if_state.back().chain_matched = condition;
-            }
-            else
-            {
-                state.if_state.back().active = false;
-            }
-        }
-        else
-        {
-            err << "Syntax error: else does not take any arguments (except when of the form 'else if')\n";
-            state.error = true;
-            return -1;
-        }
-    }
-    else
-    {
-        if (!state.if_state.back().chain_matched)
-        {
-            state.if_state.back().active = true;
-        }
-        else
-        {
-            state.if_state.back().active = false;
-        }
-    }
-
-    return 0;
-}
-
-int endif_commandlet(istream& /*in*/, ostream& /*out*/, ostream& err, global_state& state, vector<string>& args)
-{
-    if (args.size() != 0)
-    {
-        err << "Syntax error: endif does not take any arguments";
-        state.error = true;
-        return -1;
-    }
-
-    if (state.if_state.size() == 0)
-    {
-        err << "Syntax error: endif without preceding if\n";
-        state.error = true;
-        return -1;
-    }
-
-    state.if_state.pop_back();
-
-    return 0;
-}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+class global_state;
+class pattern;
+
+// The expression taken by 'if', 'else if' and 'while', parsed into a tree so it can be evaluated
+// any number of times.
+namespace IfExpression
+{
+    enum class Operator
+    {
+        None,           // Just one operand, which is true if it's a nonzero number.
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Match,
+        NotMatch,
+    };
+
+    enum class Logic
+    {
+        None,
+        And,
+        Or,
+    };
+
+    // One side of a comparison. Text with nothing in it to expand is kept as it is, along with its
+    // value as a number; anything else is split up into an expansion once, when it's parsed. An
+    // operand that's just a variable is compared as a number using the variable's cached number.
+    struct Operand
+    {
+        std::string text;
+        long long number;
+        std::unique_ptr<expansion> expanded;
+        size_t slot;
+        bool is_variable;
+
+        Operand() : text(), number(0), expanded(), slot(0), is_variable(false)
+        {}
+
+        void set(const std::string& s);
+
+        // The operand's value. storage holds it if it has to be worked out.
+        const std::string& evaluate(std::string& storage, global_state& state, std::istream& in, std::ostream& err) const;
+
+        // The operand's value as a number.
+        long long evaluate_number(global_state& state, std::istream& in, std::ostream& err) const;
+    };
+
+    struct Comparison
+    {
+        Operand expression1;
+        Operator op;
+        Operand expression2;
+
+        // For '~' and '!~' with a constant pattern: the pattern, once it has been compiled.
+        std::shared_ptr<pattern> compiled;
+
+        Comparison() : expression1(), op(Operator::None), expression2(), compiled()
+        {}
+    };
+
+    struct Expression;
+    struct CompoundExpression
+    {
+        std::unique_ptr<Expression> expr1;
+        Logic op;
+        std::unique_ptr<Expression> expr2;
+
+        CompoundExpression() : expr1(), op(Logic::None), expr2()
+        {}
+    };
+
+    struct Expression
+    {
+        enum class Type { Empty, Comparison, CompoundExpression };
+        Type type;
+        std::unique_ptr<Comparison> comparison;
+        std::unique_ptr<CompoundExpression> compound_expression;
+
+        Expression() : type(Type::Empty)
+        {}
+
+        bool evaluate(std::istream& in, std::ostream& out, std::ostream& err, global_state& state);
+    };
+
+    bool parse_if_expression(const std::vector<std::string>& args, Expression& root_expression, std::ostream& err);
+}
@@ -6,13 +6,20 @@
 #include <fstream>
 #include <unordered_map>
 #include <list>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <streambuf>
 
+#ifndef _MSC_VER
+#include <signal.h>
+#endif
+
 #include "common.h"
 #include "global_state.h"
 #include "repl.h"
+#include "commandlets.h"
+#include "pipeline.h"
 #include "stream_ex.h"
 #include "console.h"
 
@@ -30,8 +37,9 @@ int real_main(int argc, char *argv[], char *envp[])
 
         if (argc == 2)
         {
+            // The shell exits once the script ends, so a program run by its last line can take its place.
             istream_ex in(ospath(argv[1]));
-            exitCode = repl(in, out, err, gs, cin);
+            exitCode = repl(in, out, err, gs, cin, true);
         }
         else
         {
@@ -43,8 +51,20 @@ int real_main(int argc, char *argv[], char *envp[])
 
             unique_ptr<Console> con(Console::make());
 
+            // Lines entered are kept from one session to the next.
+            string history = gs.lookup_var("HISTFILE");
+            if (history.empty() && !gs.lookup_var("HOME").empty())
+            {
+                history = gs.lookup_var("HOME") + "/.wrfsh_history";
+            }
+            if (!history.empty())
+            {
+                con->open_history(history);
+            }
+
             while (!gs.exit)
             {
+                report_jobs(gs, con->ostream(), false);
                 con->prompt(gs);
                 string line = con->get_input_line();
                 in.clear();
@@ -95,6 +115,10 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 #else
 int main(int argc, char *argv[], char *envp[])
 {
+    // Writing to a pipe whose reader has gone (such as from a commandlet in a pipeline) should be
+    // an error, not kill the shell. Programs the shell runs get the default handling back.
+    signal(SIGPIPE, SIG_IGN);
+
     return real_main(argc, argv, envp);
 }
 #endif
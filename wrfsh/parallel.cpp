@@ -0,0 +1,189 @@
+#include "unicodehack.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "common.h"
+#include "global_state.h"
+#include "commandlets.h"
+#include "process.h"
+#include "parallel.h"
+
+using namespace std;
+
+namespace
+{
+    // The inputs waiting for one worker. It takes them from the front, in order; a worker that has
+    // run out takes them from the back of someone else's.
+    struct work_queue
+    {
+        mutex lock;
+        deque<size_t> items;
+    };
+
+    bool take_work(vector<work_queue>& queues, size_t self, size_t& item)
+    {
+        {
+            lock_guard<mutex> guard(queues[self].lock);
+            if (!queues[self].items.empty())
+            {
+                item = queues[self].items.front();
+                queues[self].items.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            work_queue& victim = queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.items.empty())
+            {
+                item = victim.items.back();
+                victim.items.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // The arguments for one input.
+    vector<string> make_args(const vector<string>& args, const string& input)
+    {
+        vector<string> result;
+        result.reserve(args.size() + 1);
+
+        bool substituted = false;
+        for (const string& arg : args)
+        {
+            result.push_back(arg);
+            string& r = result.back();
+            for (size_t pos = r.find("{}"); pos != string::npos; pos = r.find("{}", pos + input.size()))
+            {
+                r.replace(pos, 2, input);
+                substituted = true;
+            }
+        }
+
+        if (!substituted)
+        {
+            result.push_back(input);
+        }
+        return result;
+    }
+}
+
+int run_parallel(
+    const string& command,
+    const vector<string>& args,
+    const vector<string>& inputs,
+    size_t jobs,
+    ostream& out,
+    ostream& err,
+    global_state& state)
+{
+    commandlet_function commandlet = nullptr;
+    string path;
+
+    auto pos = special_functions.find(command);
+    if (pos != special_functions.end())
+    {
+        commandlet = pos->second;
+    }
+    else if (!state.find_command(command, path))
+    {
+        err << "Error: command not found: " << command << endl;
+        state.error = true;
+        return static_cast<int>(inputs.size());
+    }
+
+    const size_t workers = min(jobs, inputs.size());
+    if (workers == 0)
+    {
+        return 0;
+    }
+
+    // Deal the inputs out in blocks, so that stealing from the back of a queue takes the inputs
+    // furthest from where its owner is.
+    vector<work_queue> queues(workers);
+    for (size_t w = 0; w < workers; w++)
+    {
+        for (size_t i = w * inputs.size() / workers, end = (w + 1) * inputs.size() / workers; i < end; i++)
+        {
+            queues[w].items.push_back(i);
+        }
+    }
+
+    mutex output_lock;
+    atomic<int> failures(0);
+
+    auto worker = [&](size_t self)
+    {
+        global_state worker_state(state);
+        size_t item;
+        while (take_work(queues, self, item))
+        {
+            vector<string> run_args = make_args(args, inputs[item]);
+            stringstream run_in, run_out, run_err;
+            int exitCode;
+
+            if (commandlet != nullptr)
+            {
+                exitCode = commandlet(run_in, run_out, run_err, worker_state, run_args);
+                if (worker_state.error)
+                {
+                    exitCode = (exitCode == 0) ? -1 : exitCode;
+                    worker_state.error = false;
+                }
+                worker_state.exit = false;
+            }
+            else
+            {
+                Process p(command, run_args, path);
+                if (!p.Run(run_in, run_out, run_err, &exitCode))
+                {
+                    run_err << "process failed!\n";
+                    exitCode = -1;
+                }
+            }
+
+            if (exitCode != 0)
+            {
+                failures++;
+            }
+
+            const string& output = run_out.str();
+            const string& errors = run_err.str();
+            lock_guard<mutex> guard(output_lock);
+            out.write(output.data(), output.size());
+            out.flush();
+            err.write(errors.data(), errors.size());
+            err.flush();
+        }
+    };
+
+    vector<thread> threads;
+    threads.reserve(workers);
+    for (size_t w = 0; w < workers; w++)
+    {
+        threads.emplace_back(worker, w);
+    }
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+
+    return failures;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+class global_state;
+
+// Run a command once for each of a list of inputs, several at a time. Each input replaces "{}" in
+// the arguments, or is added after them if there's no "{}". At most 'jobs' run at once, each on a
+// worker thread with its own copy of the global state (as in a pipeline), and with no input. A
+// run's output and errors are written out all together once it's done, so lines from different
+// runs don't interleave. Returns the number of runs that failed.
+int run_parallel(
+    const std::string& command,
+    const std::vector<std::string>& args,
+    const std::vector<std::string>& inputs,
+    size_t jobs,
+    std::ostream& out,
+    std::ostream& err,
+    global_state& state
+    );
@@ -0,0 +1,846 @@
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <array>
+#include <bitset>
+#include <regex>
+
+#include "pattern.h"
+
+using namespace std;
+
+namespace
+{
+    const size_t cache_size = 64;
+    const size_t max_nfa_states = 10000;
+    const size_t max_dfa_states = 2000;
+    const int max_repeat = 1000;
+
+    // Thrown by the parser when a pattern uses something it doesn't handle. The pattern is then
+    // given to std::regex instead, which also takes care of reporting any errors in it.
+    struct unsupported {};
+
+    struct pattern_cache
+    {
+        // Most recently used first.
+        list<pair<string, shared_ptr<pattern>>> entries;
+        unordered_map<string, list<pair<string, shared_ptr<pattern>>>::iterator> index;
+    };
+
+    pattern_cache& cache()
+    {
+        static pattern_cache c;
+        return c;
+    }
+
+    bool is_line_terminator(char c)
+    {
+        return c == '\n' || c == '\r';
+    }
+
+    bool has_line_terminator(const char* p, const char* end)
+    {
+        for (; p != end; ++p)
+        {
+            if (is_line_terminator(*p))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The sets std::regex uses for '.', \d, \w and \s in the "C" locale.
+    bitset<256> dot_set()
+    {
+        bitset<256> set;
+        set.set();
+        set.reset('\n');
+        set.reset('\r');
+        return set;
+    }
+
+    bitset<256> class_set(char c)
+    {
+        bitset<256> set;
+        switch (c)
+        {
+        case 'd':
+        case 'D':
+            for (int i = '0'; i <= '9'; i++)
+            {
+                set.set(i);
+            }
+            break;
+        case 'w':
+        case 'W':
+            for (int i = 0; i < 256; i++)
+            {
+                if ((i >= '0' && i <= '9') || (i >= 'A' && i <= 'Z') || (i >= 'a' && i <= 'z') || i == '_')
+                {
+                    set.set(i);
+                }
+            }
+            break;
+        case 's':
+        case 'S':
+            for (char s : { ' ', '\t', '\n', '\v', '\f', '\r' })
+            {
+                set.set(static_cast<unsigned char>(s));
+            }
+            break;
+        }
+
+        if (c == 'D' || c == 'W' || c == 'S')
+        {
+            set.flip();
+        }
+        return set;
+    }
+
+    bool is_class_escape(char c)
+    {
+        return c == 'd' || c == 'D' || c == 'w' || c == 'W' || c == 's' || c == 'S';
+    }
+
+    // The character for a single-character escape (other than a class), or throw unsupported.
+    char escaped_char(char c)
+    {
+        switch (c)
+        {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        }
+
+        if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '\0')
+        {
+            // Backreferences, \b, \x, \u, \c and so on.
+            throw unsupported();
+        }
+        return c;
+    }
+}
+
+struct pattern::node
+{
+    enum class kind
+    {
+        empty,
+        chars,
+        concat,
+        alternate,
+        repeat,
+        bol,
+        eol,
+    };
+
+    kind type;
+    int set;                            // chars: index into m_sets.
+    int min;                            // repeat: the bounds. max is -1 for no limit.
+    int max;
+    vector<unique_ptr<node>> children;
+
+    explicit node(kind type) : type(type), set(-1), min(0), max(0), children() {}
+};
+
+shared_ptr<pattern> pattern::get(const string& text)
+{
+    pattern_cache& c = cache();
+
+    auto pos = c.index.find(text);
+    if (pos != c.index.end())
+    {
+        c.entries.splice(c.entries.begin(), c.entries, pos->second);
+        return pos->second->second;
+    }
+
+    auto compiled = make_shared<pattern>(text);
+
+    c.entries.emplace_front(text, compiled);
+    c.index[text] = c.entries.begin();
+
+    if (c.entries.size() > cache_size)
+    {
+        c.index.erase(c.entries.back().first);
+        c.entries.pop_back();
+    }
+
+    return compiled;
+}
+
+pattern::pattern(const string& text) :
+    m_engine(engine::dfa),
+    m_literal(),
+    m_nfa(),
+    m_sets(),
+    m_nfaStart(0),
+    m_dfa(),
+    m_dfaIndex(),
+    m_dfaStart(0),
+    m_matchesEmpty(false),
+    m_regex()
+{
+    try
+    {
+        unique_ptr<node> root = parse(text);
+
+        if (find_literal(*root))
+        {
+            m_nfa.clear();
+            m_sets.clear();
+            return;
+        }
+
+        m_nfa.push_back({ nfa_state::kind::accept, -1, -1, -1 });
+        m_nfaStart = compile(*root, 0);
+
+        state_set start = { m_nfaStart };
+        closure(start, true, true);
+        for (int s : start)
+        {
+            m_matchesEmpty |= (m_nfa[s].type == nfa_state::kind::accept);
+        }
+
+        start = { m_nfaStart };
+        closure(start, true, false);
+        m_dfaStart = dfa_state(move(start));
+    }
+    catch (const unsupported&)
+    {
+        m_engine = engine::std_regex;
+        m_nfa.clear();
+        m_sets.clear();
+        m_dfa.clear();
+        m_dfaIndex.clear();
+        m_regex = make_unique<regex>(text);
+    }
+}
+
+bool pattern::matches(const string& s)
+{
+    const size_t n = m_literal.size();
+
+    switch (m_engine)
+    {
+    case engine::literal:
+        return s == m_literal;
+
+    case engine::prefix:
+        return s.size() >= n
+            && s.compare(0, n, m_literal) == 0
+            && !has_line_terminator(s.data() + n, s.data() + s.size());
+
+    case engine::suffix:
+        return s.size() >= n
+            && s.compare(s.size() - n, n, m_literal) == 0
+            && !has_line_terminator(s.data(), s.data() + s.size() - n);
+
+    case engine::contains:
+        return !has_line_terminator(s.data(), s.data() + s.size())
+            && s.find(m_literal) != string::npos;
+
+    case engine::dfa:
+    {
+        if (s.empty())
+        {
+            return m_matchesEmpty;
+        }
+
+        int state = m_dfaStart;
+        for (char c : s)
+        {
+            int next = m_dfa[state].next[static_cast<unsigned char>(c)];
+            if (next < 0)
+            {
+                next = step(state, static_cast<unsigned char>(c));
+            }
+            state = next;
+
+            if (m_dfa[state].states.empty())
+            {
+                // Nothing can match from here on.
+                return false;
+            }
+        }
+        return m_dfa[state].accept;
+    }
+
+    case engine::std_regex:
+    default:
+        return regex_match(s, *m_regex);
+    }
+}
+
+// Parse the pattern (ECMAScript syntax, as std::regex takes it by default) into a tree. Anything
+// not handled here throws unsupported.
+unique_ptr<pattern::node> pattern::parse(const string& text)
+{
+    size_t i = 0;
+    const size_t n = text.size();
+
+    auto add_set = [this](const bitset<256>& set)
+    {
+        m_sets.push_back(set);
+        return static_cast<int>(m_sets.size() - 1);
+    };
+
+    auto chars_node = [&](const bitset<256>& set)
+    {
+        auto result = make_unique<node>(node::kind::chars);
+        result->set = add_set(set);
+        return result;
+    };
+
+    auto read_number = [&]()
+    {
+        if (i == n || text[i] < '0' || text[i] > '9')
+        {
+            throw unsupported();
+        }
+
+        int value = 0;
+        while (i < n && text[i] >= '0' && text[i] <= '9')
+        {
+            value = value * 10 + (text[i++] - '0');
+            if (value > max_repeat)
+            {
+                throw unsupported();
+            }
+        }
+        return value;
+    };
+
+    // [...]
+    auto parse_class = [&]()
+    {
+        bitset<256> set;
+        bool negate = false;
+
+        i++; // '['
+        if (i < n && text[i] == '^')
+        {
+            negate = true;
+            i++;
+        }
+
+        if (i == n || text[i] == ']')
+        {
+            // "[]" and "[^]" are special; leave them to std::regex.
+            throw unsupported();
+        }
+
+        // Read one item of the class: either a single character (returned), or a class escape
+        // (added to the set, and -1 returned).
+        auto read_item = [&]() -> int
+        {
+            char c = text[i++];
+            if (c == '[')
+            {
+                // Could be the start of a POSIX class like [:alpha:].
+                throw unsupported();
+            }
+            else if (c != '\\')
+            {
+                return static_cast<unsigned char>(c);
+            }
+
+            if (i == n)
+            {
+                throw unsupported();
+            }
+
+            c = text[i++];
+            if (is_class_escape(c))
+            {
+                set |= class_set(c);
+                return -1;
+            }
+            else if (c == 'b')
+            {
+                throw unsupported();
+            }
+            return static_cast<unsigned char>(escaped_char(c));
+        };
+
+        while (i < n && text[i] != ']')
+        {
+            int low = read_item();
+
+            if (i + 1 < n && text[i] == '-' && text[i + 1] != ']')
+            {
+                // A range.
+                i++;
+                int high = read_item();
+                if (low < 0 || high < 0 || low > high)
+                {
+                    throw unsupported();
+                }
+                for (int c = low; c <= high; c++)
+                {
+                    set.set(c);
+                }
+            }
+            else if (low >= 0)
+            {
+                set.set(low);
+            }
+        }
+
+        if (i == n)
+        {
+            throw unsupported();
+        }
+        i++; // ']'
+
+        if (negate)
+        {
+            set.flip();
+        }
+        return chars_node(set);
+    };
+
+    function<unique_ptr<node>()> parse_disjunction;
+
+    auto parse_atom = [&]() -> unique_ptr<node>
+    {
+        char c = text[i];
+        switch (c)
+        {
+        case '.':
+            i++;
+            return chars_node(dot_set());
+
+        case '[':
+            return parse_class();
+
+        case '(':
+        {
+            i++;
+            if (i < n && text[i] == '?')
+            {
+                // Only non-capturing groups; lookahead isn't a regular language.
+                if (i + 1 < n && text[i + 1] == ':')
+                {
+                    i += 2;
+                }
+                else
+                {
+                    throw unsupported();
+                }
+            }
+
+            unique_ptr<node> group = parse_disjunction();
+            if (i == n || text[i] != ')')
+            {
+                throw unsupported();
+            }
+            i++;
+            return group;
+        }
+
+        case '\\':
+        {
+            i++;
+            if (i == n)
+            {
+                throw unsupported();
+            }
+
+            c = text[i++];
+            if (is_class_escape(c))
+            {
+                return chars_node(class_set(c));
+            }
+
+            bitset<256> set;
+            set.set(static_cast<unsigned char>(escaped_char(c)));
+            return chars_node(set);
+        }
+
+        case ')':
+        case ']':
+        case '{':
+        case '}':
+        case '*':
+        case '+':
+        case '?':
+            throw unsupported();
+
+        default:
+        {
+            i++;
+            bitset<256> set;
+            set.set(static_cast<unsigned char>(c));
+            return chars_node(set);
+        }
+        }
+    };
+
+    auto parse_alternative = [&]()
+    {
+        auto seq = make_unique<node>(node::kind::concat);
+
+        while (i < n && text[i] != '|' && text[i] != ')')
+        {
+            if (text[i] == '^' || text[i] == '$')
+            {
+                seq->children.push_back(make_unique<node>(text[i] == '^' ? node::kind::bol : node::kind::eol));
+                i++;
+                continue;
+            }
+
+            unique_ptr<node> atom = parse_atom();
+
+            if (i < n && (text[i] == '*' || text[i] == '+' || text[i] == '?' || text[i] == '{'))
+            {
+                auto rep = make_unique<node>(node::kind::repeat);
+                char q = text[i++];
+                switch (q)
+                {
+                case '*': rep->min = 0; rep->max = -1; break;
+                case '+': rep->min = 1; rep->max = -1; break;
+                case '?': rep->min = 0; rep->max = 1; break;
+                case '{':
+                    rep->min = read_number();
+                    rep->max = rep->min;
+                    if (i < n && text[i] == ',')
+                    {
+                        i++;
+                        rep->max = (i < n && text[i] == '}') ? -1 : read_number();
+                    }
+                    if (i == n || text[i] != '}' || (rep->max != -1 && rep->max < rep->min))
+                    {
+                        throw unsupported();
+                    }
+                    i++;
+                    break;
+                }
+
+                // Non-greedy or not doesn't matter when the whole string has to match.
+                if (i < n && text[i] == '?')
+                {
+                    i++;
+                }
+
+                if (i < n && (text[i] == '*' || text[i] == '+' || text[i] == '?' || text[i] == '{'))
+                {
+                    throw unsupported();
+                }
+
+                rep->children.push_back(move(atom));
+                atom = move(rep);
+            }
+
+            seq->children.push_back(move(atom));
+        }
+
+        return seq;
+    };
+
+    parse_disjunction = [&]() -> unique_ptr<node>
+    {
+        unique_ptr<node> first = parse_alternative();
+        if (i == n || text[i] != '|')
+        {
+            return first;
+        }
+
+        auto alt = make_unique<node>(node::kind::alternate);
+        alt->children.push_back(move(first));
+        while (i < n && text[i] == '|')
+        {
+            i++;
+            alt->children.push_back(parse_alternative());
+        }
+        return alt;
+    };
+
+    unique_ptr<node> root = parse_disjunction();
+    if (i != n)
+    {
+        // An unmatched ')'.
+        throw unsupported();
+    }
+
+    return root;
+}
+
+// Check if the pattern is literal text with ".*" on neither, one, or both ends, and if so, set up
+// to match it with string operations.
+bool pattern::find_literal(const node& root)
+{
+    if (root.type != node::kind::concat)
+    {
+        return false;
+    }
+
+    const bitset<256> dot = dot_set();
+    auto is_dot_star = [&](const node& n)
+    {
+        return n.type == node::kind::repeat
+            && n.min == 0 && n.max == -1
+            && n.children[0]->type == node::kind::chars
+            && m_sets[n.children[0]->set] == dot;
+    };
+
+    auto& seq = root.children;
+    size_t begin = 0;
+    size_t end = seq.size();
+
+    bool leading = (begin < end && is_dot_star(*seq[begin]));
+    if (leading)
+    {
+        begin++;
+    }
+
+    bool trailing = (begin < end && is_dot_star(*seq[end - 1]));
+    if (trailing)
+    {
+        end--;
+    }
+
+    string literal;
+    for (size_t i = begin; i < end; i++)
+    {
+        if (seq[i]->type != node::kind::chars || m_sets[seq[i]->set].count() != 1)
+        {
+            return false;
+        }
+
+        const bitset<256>& set = m_sets[seq[i]->set];
+        for (int c = 0; c < 256; c++)
+        {
+            if (set.test(c))
+            {
+                literal.push_back(static_cast<char>(c));
+                break;
+            }
+        }
+    }
+
+    if ((leading || trailing) && has_line_terminator(literal.data(), literal.data() + literal.size()))
+    {
+        // ".*" can't match a line terminator, so the literal can't contain one.
+        return false;
+    }
+
+    m_literal = move(literal);
+    if (leading && trailing)
+    {
+        m_engine = engine::contains;
+    }
+    else if (leading)
+    {
+        m_engine = engine::suffix;
+    }
+    else if (trailing)
+    {
+        m_engine = engine::prefix;
+    }
+    else
+    {
+        m_engine = engine::literal;
+    }
+    return true;
+}
+
+// Add NFA states for a node, leading on to state 'next'. Returns the node's first state.
+int pattern::compile(const node& n, int next)
+{
+    if (m_nfa.size() > max_nfa_states)
+    {
+        throw unsupported();
+    }
+
+    auto add = [this](nfa_state::kind type, int set, int out, int out1)
+    {
+        m_nfa.push_back({ type, set, out, out1 });
+        return static_cast<int>(m_nfa.size() - 1);
+    };
+
+    switch (n.type)
+    {
+    case node::kind::empty:
+        return next;
+
+    case node::kind::chars:
+        return add(nfa_state::kind::chars, n.set, next, -1);
+
+    case node::kind::bol:
+        return add(nfa_state::kind::bol, -1, next, -1);
+
+    case node::kind::eol:
+        return add(nfa_state::kind::eol, -1, next, -1);
+
+    case node::kind::concat:
+        for (auto it = n.children.rbegin(); it != n.children.rend(); ++it)
+        {
+            next = compile(**it, next);
+        }
+        return next;
+
+    case node::kind::alternate:
+    {
+        int start = compile(*n.children.back(), next);
+        for (size_t i = n.children.size() - 1; i-- > 0; )
+        {
+            start = add(nfa_state::kind::split, -1, compile(*n.children[i], next), start);
+        }
+        return start;
+    }
+
+    case node::kind::repeat:
+    {
+        const node& body = *n.children[0];
+        int start = next;
+
+        if (n.max == -1)
+        {
+            // A loop: the split goes to the body (which comes back to the split) or on.
+            int loop = add(nfa_state::kind::split, -1, -1, next);
+            int body_start = compile(body, loop);
+            m_nfa[loop].out = body_start;
+            start = loop;
+        }
+        else
+        {
+            // Optional copies: each one can skip the rest.
+            for (int i = n.min; i < n.max; i++)
+            {
+                start = add(nfa_state::kind::split, -1, compile(body, start), next);
+            }
+        }
+
+        for (int i = 0; i < n.min; i++)
+        {
+            start = compile(body, start);
+        }
+        return start;
+    }
+    }
+
+    return next;
+}
+
+// Expand a set of NFA states to everything reachable without consuming a character. Only the
+// states that matter after that are kept: ones that consume a character, the accept state, and
+// end-of-string checks that haven't been followed yet.
+void pattern::closure(state_set& set, bool at_start, bool at_end) const
+{
+    vector<bool> seen(m_nfa.size());
+    vector<int> stack(set.begin(), set.end());
+    set.clear();
+
+    while (!stack.empty())
+    {
+        int s = stack.back();
+        stack.pop_back();
+
+        if (seen[s])
+        {
+            continue;
+        }
+        seen[s] = true;
+
+        const nfa_state& state = m_nfa[s];
+        switch (state.type)
+        {
+        case nfa_state::kind::split:
+            stack.push_back(state.out1);
+            stack.push_back(state.out);
+            break;
+
+        case nfa_state::kind::bol:
+            if (at_start)
+            {
+                stack.push_back(state.out);
+            }
+            break;
+
+        case nfa_state::kind::eol:
+            if (at_end)
+            {
+                stack.push_back(state.out);
+            }
+            else
+            {
+                set.push_back(s);
+            }
+            break;
+
+        case nfa_state::kind::chars:
+        case nfa_state::kind::accept:
+            set.push_back(s);
+            break;
+        }
+    }
+
+    sort(set.begin(), set.end());
+}
+
+int pattern::dfa_state(state_set set)
+{
+    auto pos = m_dfaIndex.find(set);
+    if (pos != m_dfaIndex.end())
+    {
+        return pos->second;
+    }
+
+    // It accepts if the end of the string can be reached from here.
+    state_set at_end = set;
+    closure(at_end, false, true);
+    bool accept = false;
+    for (int s : at_end)
+    {
+        accept |= (m_nfa[s].type == nfa_state::kind::accept);
+    }
+
+    dfa_entry entry;
+    entry.accept = accept;
+    entry.next.fill(-1);
+    entry.states = set;
+
+    m_dfa.push_back(move(entry));
+    int index = static_cast<int>(m_dfa.size() - 1);
+    m_dfaIndex.emplace(move(set), index);
+    return index;
+}
+
+int pattern::step(int state, unsigned char c)
+{
+    state_set next;
+    for (int s : m_dfa[state].states)
+    {
+        const nfa_state& nfa = m_nfa[s];
+        if (nfa.type == nfa_state::kind::chars && m_sets[nfa.set].test(c))
+        {
+            next.push_back(nfa.out);
+        }
+    }
+    closure(next, false, false);
+
+    if (m_dfa.size() >= max_dfa_states)
+    {
+        // Too many states have been worked out; start over rather than use unbounded memory.
+        m_dfa.clear();
+        m_dfaIndex.clear();
+
+        state_set start = { m_nfaStart };
+        closure(start, true, false);
+        m_dfaStart = dfa_state(move(start));
+
+        return dfa_state(move(next));
+    }
+
+    int result = dfa_state(move(next));
+    m_dfa[state].next[c] = result;
+    return result;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// A compiled regular expression, for the '~' and '!~' if-operators. These have the same meaning as
+// std::regex_match with the default (ECMAScript) syntax: the whole string has to match.
+//
+// Patterns that are just literal text, optionally with ".*" on either end, are matched with plain
+// string comparisons. Other patterns made of characters, classes, groups, alternation, repetition
+// and anchors are compiled to an NFA, which is turned into a DFA lazily as it's used. Anything else
+// (backreferences, lookahead, word boundaries, and anything that isn't valid) is left to
+// std::regex.
+class pattern
+{
+public:
+    // Get the compiled form of a pattern, from a cache of recently used patterns if possible.
+    // Throws std::regex_error if the pattern isn't valid.
+    static std::shared_ptr<pattern> get(const std::string& text);
+
+    pattern(const std::string& text);
+
+    bool matches(const std::string& s);
+
+private:
+    struct node;
+    std::unique_ptr<node> parse(const std::string& text);
+    bool find_literal(const node& root);
+    int compile(const node& n, int next);
+
+    // The DFA's states are sets of NFA states.
+    typedef std::vector<int> state_set;
+    void closure(state_set& set, bool at_start, bool at_end) const;
+    int dfa_state(state_set set);
+    int step(int state, unsigned char c);
+
+    enum class engine
+    {
+        literal,    // The whole string equals m_literal.
+        prefix,     // m_literal, then anything on the same line.
+        suffix,     // Anything on one line, then m_literal.
+        contains,   // m_literal somewhere in a single line.
+        dfa,
+        std_regex,
+    };
+    engine m_engine;
+    std::string m_literal;
+
+    struct nfa_state
+    {
+        enum class kind
+        {
+            split,      // Go to both out and out1 without consuming anything.
+            bol,        // Go to out, but only at the start of the string.
+            eol,        // Go to out, but only at the end of the string.
+            chars,      // Consume a character in the set, and go to out.
+            accept,
+        };
+        kind type;
+        int set;                        // Index into m_sets.
+        int out;
+        int out1;
+    };
+    std::vector<nfa_state> m_nfa;
+    std::vector<std::bitset<256>> m_sets;
+    int m_nfaStart;
+
+    struct dfa_entry
+    {
+        state_set states;
+        bool accept;
+        std::array<int, 256> next;      // -1 until worked out.
+    };
+    std::vector<dfa_entry> m_dfa;
+    std::map<state_set, int> m_dfaIndex;
+    int m_dfaStart;
+    bool m_matchesEmpty;
+
+    std::unique_ptr<std::regex> m_regex;
+};
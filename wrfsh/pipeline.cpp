@@ -0,0 +1,529 @@
+#include "unicodehack.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <sstream>
+#include <array>
+#include <thread>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#endif
+
+#include "common.h"
+#include "global_state.h"
+#include "commandlets.h"
+#include "process.h"
+#include "stream_ex.h"
+#include "pipeline.h"
+
+using namespace std;
+
+#ifdef _MSC_VER
+
+int run_pipeline(vector<pipeline_stage>& stages, istream& in, ostream& out, ostream& err, global_state& state)
+{
+    // No pipes here: the stages run one after another, and each one's output is collected for the
+    // next one.
+    int exitCode = 0;
+    unique_ptr<stringstream> input;
+    for (size_t i = 0, n = stages.size(); i < n; i++)
+    {
+        pipeline_stage& stage = stages[i];
+        unique_ptr<stringstream> output = (i + 1 < n) ? make_unique<stringstream>() : nullptr;
+        istream& stageIn = (input != nullptr) ? *input : in;
+        ostream& stageOut = (output != nullptr) ? *output : out;
+
+        if (stage.commandlet != nullptr)
+        {
+            exitCode = stage.commandlet(stageIn, stageOut, err, state, stage.args);
+        }
+        else
+        {
+            Process p(stage.program, stage.args);
+            if (!p.Run(stageIn, stageOut, err, &exitCode))
+            {
+                err << "process failed!\n";
+                state.error = true;
+                return -1;
+            }
+        }
+
+        input = move(output);
+    }
+
+    return exitCode;
+}
+
+bool start_job(vector<pipeline_stage>& /*stages*/, istream& /*in*/, ostream& /*out*/, ostream& err, global_state& state)
+{
+    err << "Error: background jobs aren't supported on Windows yet\n";
+    state.error = true;
+    return false;
+}
+
+bool finish_job(global_state& /*state*/, size_t /*index*/, bool /*block*/, int* pExitCode)
+{
+    *pExitCode = -1;
+    return true;
+}
+
+bool find_job(global_state& /*state*/, const string& /*spec*/, size_t& /*index*/)
+{
+    return false;
+}
+
+void wait_for_any_job(global_state& /*state*/)
+{
+}
+
+#else
+
+namespace
+{
+    // A commandlet that isn't the last stage. It runs on its own thread, with its own copy of the
+    // global state, and its errors are held until it's done.
+    struct commandlet_thread
+    {
+        global_state state;
+        stringstream err;
+        int exitCode;
+        thread worker;
+
+        commandlet_thread(const global_state& s) : state(s), err(), exitCode(0), worker()
+        {}
+    };
+
+    // Find all the programs in a pipeline, so that nothing is started if one is missing.
+    bool find_programs(const vector<pipeline_stage>& stages, vector<string>& paths, ostream& err, global_state& state)
+    {
+        paths.resize(stages.size());
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            if (stages[i].commandlet == nullptr && !state.find_command(stages[i].program, paths[i]))
+            {
+                err << "Error: command not found: " << stages[i].program << endl;
+                state.error = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Make the pipes between the stages. They're close-on-exec, so each child only keeps the ones
+    // it's given as its stdin and stdout.
+    bool make_pipes(vector<array<int, 2>>& pipes, ostream& err, global_state& state)
+    {
+        for (size_t i = 0; i < pipes.size(); i++)
+        {
+            if (pipe2(pipes[i].data(), O_CLOEXEC) != 0)
+            {
+                err << "Error: can't make a pipe: " << strerror(errno) << endl;
+                for (size_t j = 0; j < i; j++)
+                {
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
+                state.error = true;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int run_pipeline(vector<pipeline_stage>& stages, istream& in, ostream& out, ostream& err, global_state& state)
+{
+    const size_t n = stages.size();
+
+    vector<string> paths;
+    if (!find_programs(stages, paths, err, state))
+    {
+        return -1;
+    }
+
+    // Programs that share the shell's output write to it directly, after what's been written.
+    out.flush();
+    err.flush();
+
+    // pipes[i] connects stage i to stage i + 1, and pipes[n - 1] is for copying the output of the
+    // last stage, if it's an external program and out isn't a file.
+    int outFd = Process::StreamHandle(&out, &cout);
+    const bool copyOut = (outFd == -2 && stages.back().commandlet == nullptr);
+
+    vector<array<int, 2>> pipes(copyOut ? n : n - 1);
+    if (!make_pipes(pipes, err, state))
+    {
+        return -1;
+    }
+
+    if (copyOut)
+    {
+        outFd = pipes[n - 1][1];
+    }
+
+    // If the first stage is a program and in isn't a file (such as a here-string), it's fed
+    // through one more pipe.
+    int inFd = Process::StreamHandle(&in, &cin);
+    int feed[2] = { -1, -1 };
+    if (inFd == -2 && stages[0].commandlet == nullptr)
+    {
+        if (pipe2(feed, O_CLOEXEC) != 0)
+        {
+            err << "Error: can't make a pipe: " << strerror(errno) << endl;
+            feed[0] = feed[1] = -1;
+        }
+        inFd = feed[0];
+    }
+
+    // Programs can only write the shell's errors directly if it's a file (or the standard stream).
+    // Otherwise they get the shell's own stderr.
+    int errFd = Process::StreamHandle(&err, &cerr);
+    inFd = (inFd == -2) ? -1 : inFd;
+    errFd = (errFd == -2) ? -1 : errFd;
+
+    vector<unique_ptr<Process>> processes(n);
+    vector<unique_ptr<commandlet_thread>> threads;
+    bool started = true;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        pipeline_stage& stage = stages[i];
+        int readFd = (i > 0) ? pipes[i - 1][0] : -1;
+        int writeFd = (i + 1 < n || copyOut) ? pipes[i][1] : -1;
+
+        if (stage.commandlet == nullptr)
+        {
+            const int fds[3] = { (readFd != -1) ? readFd : inFd, (writeFd != -1) ? writeFd : outFd, errFd };
+            processes[i] = make_unique<Process>(stage.program, stage.args, paths[i]);
+            if (!processes[i]->Start(fds, err))
+            {
+                started = false;
+            }
+
+            // The child has its own copies now. Once ours are closed, the stages on either side
+            // see the end of the data (or a broken pipe) when it exits.
+            if (readFd != -1)
+            {
+                close(readFd);
+            }
+            else if (feed[0] != -1)
+            {
+                close(feed[0]);
+            }
+            if (writeFd != -1)
+            {
+                close(writeFd);
+            }
+        }
+        else if (i + 1 < n)
+        {
+            threads.push_back(make_unique<commandlet_thread>(state));
+            commandlet_thread* t = threads.back().get();
+            t->worker = thread([t, &stage, &in, readFd, writeFd]()
+            {
+                // The streams own the pipe ends, and close them when the commandlet is done.
+                unique_ptr<istream_ex> pipeIn;
+                if (readFd != -1)
+                {
+                    pipeIn = make_unique<istream_ex>(readFd);
+                }
+                ostream_ex pipeOut(writeFd);
+
+                t->exitCode = stage.commandlet((pipeIn != nullptr) ? *pipeIn : in, pipeOut, t->err, t->state, stage.args);
+            });
+        }
+    }
+
+    int exitCode = -1;
+    if (stages.back().commandlet != nullptr)
+    {
+        // The last commandlet runs here, with the real global state, so it can set variables. Any
+        // input for the first stage has to be fed from another thread meanwhile.
+        thread feeder;
+        if (feed[1] != -1)
+        {
+            feeder = thread([&in, &out, &err, &feed]()
+            {
+                Process::Copy(feed[1], in, -1, out, -1, err);
+            });
+        }
+
+        unique_ptr<istream_ex> pipeIn;
+        if (n > 1)
+        {
+            pipeIn = make_unique<istream_ex>(pipes[n - 2][0]);
+        }
+        exitCode = stages.back().commandlet((pipeIn != nullptr) ? *pipeIn : in, out, err, state, stages.back().args);
+
+        if (feeder.joinable())
+        {
+            feeder.join();
+        }
+    }
+    else if (copyOut || feed[1] != -1)
+    {
+        int copyFd = copyOut ? pipes[n - 1][0] : -1;
+        Process::Copy(feed[1], in, copyFd, out, -1, err);
+        if (copyFd != -1)
+        {
+            close(copyFd);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (processes[i] != nullptr)
+        {
+            int processExitCode;
+            processes[i]->Wait(&processExitCode);
+            if (i == n - 1)
+            {
+                exitCode = processExitCode;
+            }
+        }
+    }
+
+    for (auto& t : threads)
+    {
+        t->worker.join();
+        err << t->err.str();
+        if (t->state.error)
+        {
+            state.error = true;
+        }
+    }
+
+    if (!started)
+    {
+        state.error = true;
+    }
+
+    return exitCode;
+}
+
+bool start_job(vector<pipeline_stage>& stages, istream& in, ostream& out, ostream& err, global_state& state)
+{
+    const size_t n = stages.size();
+
+    for (const pipeline_stage& stage : stages)
+    {
+        if (stage.commandlet != nullptr)
+        {
+            err << "Error: commandlets can't run in the background\n";
+            state.error = true;
+            return false;
+        }
+    }
+
+    vector<string> paths;
+    if (!find_programs(stages, paths, err, state))
+    {
+        return false;
+    }
+
+    out.flush();
+    err.flush();
+
+    vector<array<int, 2>> pipes(n - 1);
+    if (!make_pipes(pipes, err, state))
+    {
+        return false;
+    }
+
+    // A job mustn't take the shell's own input.
+    int inFd = Process::StreamHandle(&in, &cin);
+    int devNull = -1;
+    if (inFd < 0)
+    {
+        devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        inFd = devNull;
+    }
+
+    int outFd = Process::StreamHandle(&out, &cout);
+    int errFd = Process::StreamHandle(&err, &cerr);
+    outFd = (outFd == -2) ? -1 : outFd;
+    errFd = (errFd == -2) ? -1 : errFd;
+
+    global_state::job job;
+    job.number = state.jobs.empty() ? 1 : state.jobs.back().number + 1;
+
+    bool started = true;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i > 0)
+        {
+            job.command.append(" | ");
+        }
+        job.command.append(stages[i].program);
+        for (const string& arg : stages[i].args)
+        {
+            job.command.push_back(' ');
+            job.command.append(arg);
+        }
+
+        const int fds[3] = { (i > 0) ? pipes[i - 1][0] : inFd, (i + 1 < n) ? pipes[i][1] : outFd, errFd };
+        auto process = make_shared<Process>(stages[i].program, stages[i].args, paths[i]);
+        if (process->Start(fds, err))
+        {
+            job.processes.push_back(move(process));
+        }
+        else
+        {
+            started = false;
+        }
+
+        if (i > 0)
+        {
+            close(pipes[i - 1][0]);
+        }
+        if (i + 1 < n)
+        {
+            close(pipes[i][1]);
+        }
+    }
+
+    if (devNull != -1)
+    {
+        close(devNull);
+    }
+
+    if (!started)
+    {
+        state.error = true;
+    }
+
+    if (job.processes.empty())
+    {
+        return false;
+    }
+
+    string pid = to_string(job.processes.back()->Pid());
+    if (state.interactive)
+    {
+        err << "[" << job.number << "] " << pid << endl;
+    }
+    state.let("!", pid);
+    state.jobs.push_back(move(job));
+    return started;
+}
+
+bool finish_job(global_state& state, size_t index, bool block, int* pExitCode)
+{
+    for (auto& process : state.jobs[index].processes)
+    {
+        if (block)
+        {
+            process->Wait(pExitCode);
+        }
+        else if (!process->Finished(pExitCode))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool find_job(global_state& state, const string& spec, size_t& index)
+{
+    const bool by_number = (!spec.empty() && spec[0] == '%');
+    const long long number = to_number(by_number ? spec.substr(1) : spec);
+    for (index = 0; index < state.jobs.size(); index++)
+    {
+        const global_state::job& job = state.jobs[index];
+        if (by_number)
+        {
+            if (job.number == number)
+            {
+                return true;
+            }
+            continue;
+        }
+
+        for (const auto& process : job.processes)
+        {
+            if (process->Pid() == number)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void wait_for_any_job(global_state& state)
+{
+    // Wait on the pidfds of everything that's still running, all at once. (Where there aren't
+    // any, wait for the first program that's still running instead.) A program finishing doesn't
+    // always finish its job, but it won't be waited on again.
+    vector<pollfd> fds;
+    for (auto& job : state.jobs)
+    {
+        bool running = false;
+        for (auto& process : job.processes)
+        {
+            int exitCode;
+            if (process->Finished(&exitCode))
+            {
+                continue;
+            }
+
+            int fd = process->ExitHandle();
+            if (fd == -1)
+            {
+                process->Wait(&exitCode);
+                return;
+            }
+            fds.push_back({ fd, POLLIN, 0 });
+            running = true;
+        }
+
+        if (!running)
+        {
+            return;
+        }
+    }
+
+    if (fds.empty())
+    {
+        return;
+    }
+
+    while (poll(fds.data(), fds.size(), -1) == -1 && errno == EINTR)
+    {
+    }
+}
+
+#endif
+
+void report_jobs(global_state& state, ostream& out, bool all)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < state.jobs.size(); i++)
+    {
+        global_state::job& job = state.jobs[i];
+        int exitCode;
+        bool done = finish_job(state, i, false, &exitCode);
+        if (done || all)
+        {
+            out << "[" << job.number << "] " << (done ? "Done" : "Running") << "    " << job.command << "\n";
+        }
+
+        if (!done)
+        {
+            if (kept != i)
+            {
+                state.jobs[kept] = move(job);
+            }
+            kept++;
+        }
+    }
+    state.jobs.erase(state.jobs.begin() + kept, state.jobs.end());
+}
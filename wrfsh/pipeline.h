@@ -0,0 +1,51 @@
+#pragma once
+
+class global_state;
+
+// One command in a pipeline, with its arguments already expanded.
+struct pipeline_stage
+{
+    std::string program;                // The external program, if there's no commandlet.
+    commandlet_function commandlet;
+    std::vector<std::string> args;
+};
+
+// Run the stages of a pipeline all at once, each one's output connected to the next one's input
+// by a pipe. The first stage reads from in, and the last one writes to out. External programs get
+// the pipes directly; commandlets other than the last one run on threads of their own, with a copy
+// of the global state (like a subshell). Returns the exit code of the last stage.
+int run_pipeline(
+    std::vector<pipeline_stage>& stages,
+    std::istream& in,
+    std::ostream& out,
+    std::ostream& err,
+    global_state& state
+    );
+
+// Start a pipeline like run_pipeline(), but in the background as a new job, without waiting for
+// it. Only external programs can run in the background. Their input is /dev/null unless it's
+// redirected from a file, and output that isn't going to a file goes to the shell's own stdout
+// and stderr. Sets $! to the pid of the last program. Returns false if it couldn't be started.
+bool start_job(
+    std::vector<pipeline_stage>& stages,
+    std::istream& in,
+    std::ostream& out,
+    std::ostream& err,
+    global_state& state
+    );
+
+// Check whether the job at the given index in the job table has finished, or if block is true,
+// wait for it to. Returns true once it has, with the exit code of its last program. The job is
+// left in the table.
+bool finish_job(global_state& state, size_t index, bool block, int* pExitCode);
+
+// Find a job by its number ("%n"), or the pid of one of its programs. Returns false if there
+// isn't one.
+bool find_job(global_state& state, const std::string& spec, size_t& index);
+
+// Wait until at least one job has finished, if there are any.
+void wait_for_any_job(global_state& state);
+
+// Remove the jobs that have finished from the table, and list them to out as done. If all is
+// true, also list the ones that are still running.
+void report_jobs(global_state& state, std::ostream& out, bool all);
@@ -4,13 +4,25 @@
 #include <string>
 #include <vector>
 
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "common.h"
 #include "process.h"
 
 using namespace std;
 
-Process::Process(const string program, const vector<string> args) :
+Process::Process(const string program, const vector<string> args, const string path) :
     m_program(program),
-    m_args(args)
+    m_args(args),
+    m_path(path)
+#ifndef _MSC_VER
+    , m_pid(-1)
+    , m_pidFd(-1)
+    , m_exited(false)
+    , m_exitCode(-1)
+#endif
 {
 #ifdef _MSC_VER
     // Commands implemented by cmd.exe
@@ -25,6 +37,16 @@ Process::Process(const string program, const vector<string> args) :
 #endif
 }
 
+Process::~Process()
+{
+#ifndef _MSC_VER
+    if (m_pidFd != -1)
+    {
+        close(m_pidFd);
+    }
+#endif
+}
+
 bool Process::Run(istream& in, ostream& out, ostream& err, int *pExitCode)
 {
 #ifdef _MSC_VER
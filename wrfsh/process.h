@@ -3,14 +3,69 @@
 class Process
 {
 public:
-    Process(const std::string program, const std::vector<std::string> args);
+    Process(const std::string program, const std::vector<std::string> args, const std::string path = std::string());
+    ~Process();
+
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    // Find the program that running 'name' would run: names with a slash in them are used as
+    // they are, and anything else is looked for in the directories listed in search_path.
+    // Returns false if it isn't found. cacheable is set to false if the answer could change
+    // without search_path changing (such as when it depends on the current directory).
+    static bool Find(const std::string& name, const std::string& search_path, std::string& full_path, bool& cacheable);
 
     bool Run(std::istream& in, std::ostream& out, std::ostream& err, int* pExitCode);
 
+    // Replace the shell with the program, like exec(). This can only be done if the program can be
+    // given the streams' descriptors directly (see StreamHandle()), so that there's nothing left
+    // for the shell to copy. Only returns if it couldn't be done, with everything as it was; the
+    // program should be Run() instead.
+    void Exec(std::istream& in, std::ostream& out, std::ostream& err);
+
+#ifndef _MSC_VER
+    // Start the program with the given file descriptors as its stdin, stdout and stderr (-1 leaves
+    // one as the shell's own), and return without waiting for it to finish. The descriptors
+    // should be close-on-exec. Returns false if it couldn't be started.
+    bool Start(const int fds[3], std::ostream& err);
+
+    // Wait for a program started with Start() to finish.
+    void Wait(int* pExitCode);
+
+    // Check whether a program started with Start() has finished, without waiting. Returns true
+    // (with its exit code) once it has.
+    bool Finished(int* pExitCode);
+
+    // A descriptor that becomes readable once the program has finished (a pidfd), for waiting on
+    // several at once with poll(). It's opened the first time it's asked for. -1 if the system
+    // doesn't have them.
+    int ExitHandle();
+
+    pid_t Pid() const;
+
+    // The file descriptor a child process should get for one of the shell's streams: -1 for a
+    // standard stream or the console (which the child inherits), the descriptor behind a
+    // stream_ex, or -2 if the stream has no descriptor and the shell has to copy its data.
+    static int StreamHandle(std::ios* stream, std::ios* stdStream);
+
+    // Copy in to inFd, and outFd and errFd to out and err, until the other ends of the pipes are
+    // closed. This is what Run() does for streams with no descriptor. Any of the fds can be -1.
+    // inFd is closed once in runs out (or the reader goes away); the others are left open.
+    static void Copy(int inFd, std::istream& in, int outFd, std::ostream& out, int errFd, std::ostream& err);
+#endif
+
 private:
     bool Run_Win32(std::istream& in, std::ostream& out, std::ostream& err, int* pExitCode);
     bool Run_Posix(std::istream& in, std::ostream& out, std::ostream& err, int* pExitCode);
 
     std::string m_program;
     std::vector<std::string> m_args;
+    std::string m_path;                 // Where the program is, if already known.
+
+#ifndef _MSC_VER
+    pid_t m_pid;                        // Set by Start().
+    int m_pidFd;                        // Opened by ExitHandle().
+    bool m_exited;                      // Whether it's been waited for, and its exit code if so.
+    int m_exitCode;
+#endif
 };
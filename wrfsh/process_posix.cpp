@@ -10,12 +10,21 @@
 #include <memory>
 
 #include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <errno.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <assert.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
 #include "stream_ex.h"
 #include "console.h"
 #include "process.h"
@@ -75,212 +84,617 @@ private:
     bool m_closed;
 };
 
-struct ReadThreadArgs
+// Copies data between a child process's pipes and the shell's streams, all from the thread that's
+// waiting for it. Each thread has one, which is reused (along with its buffers) for every command
+// it runs. On Linux it waits with epoll; elsewhere with poll().
+class IoReactor
 {
-    ManagedHandle* childHandle; // For talking with the child process
-    ostream* stream; // For talking with the shell
+public:
+    IoReactor() : m_readBuffer(64 * 1024), m_writeBuffer(64 * 1024)
+#ifdef __linux__
+        , m_epoll(epoll_create1(EPOLL_CLOEXEC))
+#endif
+    {
+    }
+
+    ~IoReactor()
+    {
+#ifdef __linux__
+        if (m_epoll != -1)
+        {
+            close(m_epoll);
+        }
+#endif
+    }
+
+    // See Process::Copy().
+    void Run(int inFd, istream& in, int outFd, ostream& out, int errFd, ostream& err);
+
+private:
+    struct Channel
+    {
+        int fd;
+        istream* in;                    // Where the data comes from, for the child's stdin.
+        ostream* out;                   // Where it goes, for its stdout and stderr.
+    };
+
+    bool Wait(Channel channels[3], bool ready[3]);
+    bool Read(Channel& channel);
+    bool Write(Channel& channel);
+
+    vector<char> m_readBuffer;
+    vector<char> m_writeBuffer;
+    size_t m_writeStart;                // What's in m_writeBuffer that hasn't been written yet.
+    size_t m_writeEnd;
+#ifdef __linux__
+    int m_epoll;
+#endif
 };
 
-struct WriteThreadArgs
+void IoReactor::Run(int inFd, istream& in, int outFd, ostream& out, int errFd, ostream& err)
 {
-    ManagedHandle* childHandle;
-    istream* stream;
-};
+    Channel channels[3] = { { inFd, &in, nullptr }, { outFd, nullptr, &out }, { errFd, nullptr, &err } };
+    m_writeStart = m_writeEnd = 0;
+
+    for (Channel& channel : channels)
+    {
+        if (channel.fd == -1)
+        {
+            continue;
+        }
+
+        fcntl(channel.fd, F_SETFL, fcntl(channel.fd, F_GETFL) | O_NONBLOCK);
+
+#ifdef __linux__
+        epoll_event event = {};
+        event.events = (channel.in != nullptr) ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = &channel;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, channel.fd, &event);
+#endif
+    }
+
+    bool ready[3];
+    while (Wait(channels, ready))
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            Channel& channel = channels[i];
+            if (!ready[i] || channel.fd == -1)
+            {
+                continue;
+            }
+
+            bool open = (channel.in != nullptr) ? Write(channel) : Read(channel);
+            if (!open)
+            {
+#ifdef __linux__
+                epoll_ctl(m_epoll, EPOLL_CTL_DEL, channel.fd, nullptr);
+#endif
+                if (channel.in != nullptr)
+                {
+                    close(channel.fd);
+                }
+                channel.fd = -1;
+            }
+        }
+    }
+}
 
-void* ReadThreadProc(void *param)
+// Wait for some of the channels to be ready. Returns false once they're all closed.
+bool IoReactor::Wait(Channel channels[3], bool ready[3])
 {
-    auto args = reinterpret_cast<ReadThreadArgs*>(param);
-    ostream* out = args->stream;
+    int open = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        ready[i] = false;
+        open += (channels[i].fd != -1);
+    }
+
+    if (open == 0)
+    {
+        return false;
+    }
+
+#ifdef __linux__
+    epoll_event events[3];
+    int count = epoll_wait(m_epoll, events, 3, -1);
+    for (int i = 0; i < count; i++)
+    {
+        ready[static_cast<Channel*>(events[i].data.ptr) - channels] = true;
+    }
+#else
+    pollfd fds[3];
+    for (int i = 0; i < 3; i++)
+    {
+        fds[i].fd = channels[i].fd;
+        fds[i].events = (channels[i].in != nullptr) ? POLLOUT : POLLIN;
+        fds[i].revents = 0;
+    }
+    int count = poll(fds, 3, -1);
+    for (int i = 0; i < 3 && count > 0; i++)
+    {
+        ready[i] = (fds[i].revents != 0);
+    }
+#endif
+
+    if (count == -1 && errno != EINTR)
+    {
+        cerr << "wait error: " << strerror(errno) << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Copy whatever the child has written. Returns false once it's closed its end.
+bool IoReactor::Read(Channel& channel)
+{
+    // Output that's being captured is read straight into the capture buffer.
+    capture_buf* capture = dynamic_cast<capture_buf*>(channel.out->rdbuf());
 
-    char readBuf[512];
     for (;;)
     {
-        ssize_t bytesRead = read(*(args->childHandle), readBuf, 512);
+        char* buffer = (capture != nullptr) ? capture->reserve(m_readBuffer.size()) : m_readBuffer.data();
+        ssize_t bytesRead = read(channel.fd, buffer, m_readBuffer.size());
         if (bytesRead == -1)
         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
             cerr << "read error: " << strerror(errno) << endl;
-            break;
+            return false;
         }
 
         if (bytesRead == 0)
         {
-            break;
+            return false;
         }
 
-        out->write(readBuf, bytesRead);
+        if (capture != nullptr)
+        {
+            capture->commit(bytesRead);
+        }
+        else
+        {
+            channel.out->write(m_readBuffer.data(), bytesRead);
+        }
     }
-
-    return nullptr;
 }
 
-void* WriteThreadProc(void* param)
+// Give the child as much of its input as it'll take. Returns false once all of it has been
+// written, or the child has closed its end.
+bool IoReactor::Write(Channel& channel)
 {
-    auto args = reinterpret_cast<WriteThreadArgs*>(param);
-    
-    //TODO FIXME
-    (void) args;
-    cout << "hello from write proc\n";
+    for (;;)
+    {
+        if (m_writeStart == m_writeEnd)
+        {
+            channel.in->read(m_writeBuffer.data(), m_writeBuffer.size());
+            m_writeStart = 0;
+            m_writeEnd = static_cast<size_t>(channel.in->gcount());
+            if (m_writeEnd == 0)
+            {
+                return false;
+            }
+        }
 
-    return nullptr;
+        ssize_t bytesWritten = write(channel.fd, m_writeBuffer.data() + m_writeStart, m_writeEnd - m_writeStart);
+        if (bytesWritten == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            // Most likely EPIPE: the child doesn't want the rest.
+            return false;
+        }
+
+        m_writeStart += bytesWritten;
+    }
 }
 
-bool Process::Run_Posix(istream& in, ostream& out, ostream& err, int *pExitCode)
+// Report why a program couldn't be started.
+static void ReportStartError(const string& program, int error, ostream& err)
 {
-    *pExitCode = -1;
+    if (error == ENOENT)
+    {
+        err << "Error: command not found: " << program << endl;
+    }
+    else
+    {
+        err << "Error: can't run " << program << ": " << strerror(error) << endl;
+    }
+}
 
-    ManagedHandle fdIn, fdOut, fdErr;
-    ManagedHandle fdThreadIn, fdThreadOut, fdThreadErr;
-    bool needs_io_thread = false;
+bool Process::Find(const string& name, const string& search_path, string& full_path, bool& cacheable)
+{
+    if (name.find('/') != string::npos)
+    {
+        // Not searched for. If it doesn't exist, that gets reported when it's run.
+        full_path = name;
+        cacheable = false;
+        return true;
+    }
 
-    auto fn = [&needs_io_thread](
-        ManagedHandle& childFd,
-        ManagedHandle& threadFd,
-        ManagedHandle& readFd,
-        ManagedHandle& writeFd,
-        ios* stream,
-        ios* stdStream,
-        int stdFd)
+    cacheable = true;
+    size_t start = 0;
+    for (;;)
     {
-        auto str_ex = dynamic_cast<stream_ex*>(stream);
-        if ((str_ex == nullptr) ? ((stream == stdStream)
-                                    || (dynamic_cast<Console_streambuf*>(stream->rdbuf()) != nullptr))
-                                : (*str_ex == *stdStream))
+        size_t end = search_path.find(':', start);
+        if (end == string::npos)
         {
-            // It's a standard stream, or a stream_ex wrapping a standard stream, or a stream backed by the console.
-            childFd = stdFd;
-            childFd.LeaveOpen();
-            threadFd = -1;
+            end = search_path.size();
         }
-        else
+
+        // An empty entry means the current directory. Anything found relative to the current
+        // directory, or after looking there, can't be cached.
+        string dir = search_path.substr(start, end - start);
+        if (dir.empty() || dir[0] != '/')
         {
-            if (str_ex != nullptr)
-            {
-                // It's a stream_ex wrapping some file handle.
-                childFd = str_ex->get_native_handle();
-                childFd.LeaveOpen();
-                threadFd = -1;
-                assert(childFd != -1);
-            }
-            else
-            {
-                // It's some other kind of stream.
-                needs_io_thread = true;
-                int fd[2];
-                pipe(fd);
-                readFd = fd[0];
-                writeFd = fd[1];
-            }
+            cacheable = false;
         }
-    };
 
-    // child  thread       read         write       stream  std    fd
-    fn(fdIn,  fdThreadIn,  fdIn,        fdThreadIn, &in,    &cin,  0);
-    fn(fdOut, fdThreadOut, fdThreadOut, fdOut,      &out,   &cout, 1);
-    fn(fdErr, fdThreadErr, fdThreadErr, fdErr,      &err,   &cerr, 2);
+        string candidate = dir.empty() ? name : dir + "/" + name;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0)
+        {
+            full_path = move(candidate);
+            return true;
+        }
+
+        if (end == search_path.size())
+        {
+            break;
+        }
+        start = end + 1;
+    }
+
+    return false;
+}
+
+// Start the child process. fds are what it gets as its stdin, stdout and stderr; -1 leaves one as
+// the shell's own. closeFds are the other ends of any pipes in fds that were opened without
+// O_CLOEXEC (or -1), which the child mustn't keep open. If path is empty, the program is looked
+// for on the PATH. Returns the child's pid, or -1 if it couldn't be started.
+//
+// This uses posix_spawn where it's available. glibc implements it with clone(CLONE_VM |
+// CLONE_VFORK), so unlike fork() it doesn't copy the shell's page tables, which gets slower the
+// bigger the heap is. It also reports a program that can't be run as an error here, instead of
+// from inside the child.
+static pid_t StartChild(const string& program, const string& path, const vector<const char*>& args, const int fds[3], const int closeFds[3], ostream& err)
+{
+#ifdef _POSIX_SPAWN
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1 && fds[i] != i)
+        {
+            posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+        }
+        if (closeFds[i] != -1)
+        {
+            posix_spawn_file_actions_addclose(&actions, fds[i]);
+            posix_spawn_file_actions_addclose(&actions, closeFds[i]);
+        }
+    }
 
+    // The shell ignores SIGPIPE (see main), but programs it runs shouldn't.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaultSignals;
+    sigemptyset(&defaultSignals);
+    sigaddset(&defaultSignals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int result = path.empty()
+        ? posix_spawnp(&pid, program.c_str(), &actions, &attr, const_cast<char * const *>(&args[0]), environ)
+        : posix_spawn(&pid, path.c_str(), &actions, &attr, const_cast<char * const *>(&args[0]), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (result != 0)
+    {
+        ReportStartError(program, result, err);
+        return -1;
+    }
+    return pid;
+#else
     pid_t pid = fork();
     if (pid == -1)
     {
         err << "fork failed (" << errno << ") in running child process\n";
-        return false;
     }
     else if (pid == 0)
     {
         // Child
-
-        if (needs_io_thread)
+        for (int i = 0; i < 3; i++)
         {
-            auto prepareFDs = [](
-                ManagedHandle& myFd,
-                ManagedHandle& threadFd,
-                int standardFd
-                )
+            if (fds[i] != -1 && fds[i] != i)
             {
-                if (threadFd != -1)
-                {
-                    dup2(myFd, standardFd);
-                    myFd.Close();
-                    threadFd.Close();
-                }
-            };
-
-            prepareFDs(fdIn, fdThreadIn, 0);
-            prepareFDs(fdOut, fdThreadOut, 1);
-            prepareFDs(fdErr, fdThreadErr, 2);
+                dup2(fds[i], i);
+            }
+            if (closeFds[i] != -1)
+            {
+                close(fds[i]);
+                close(closeFds[i]);
+            }
         }
 
-        vector<const char*> args;
-        args.push_back(m_program.c_str());
-        for (const string& arg : m_args)
+        signal(SIGPIPE, SIG_DFL);
+
+        if (path.empty())
+        {
+            execvp(program.c_str(), const_cast<char * const *>(&args[0]));
+        }
+        else
         {
-            args.push_back(arg.c_str());
+            execv(path.c_str(), const_cast<char * const *>(&args[0]));
         }
-        args.push_back(nullptr);
 
-        execvp(m_program.c_str(), const_cast<char * const *>(&args[0]));
+        // The program couldn't be run. The child must not carry on running the shell.
+        ReportStartError(program, errno, cerr);
+        _exit(127);
+    }
+    return pid;
+#endif
+}
+
+int Process::StreamHandle(ios* stream, ios* stdStream)
+{
+    auto str_ex = dynamic_cast<stream_ex*>(stream);
+    if ((str_ex == nullptr) ? ((stream == stdStream)
+                                || (dynamic_cast<Console_streambuf*>(stream->rdbuf()) != nullptr))
+                            : (*str_ex == *stdStream))
+    {
+        // It's a standard stream, or a stream_ex wrapping a standard stream, or a stream backed by the console.
+        return -1;
+    }
+    else if (str_ex != nullptr && str_ex->get_native_handle() != -1)
+    {
+        // It's a stream_ex wrapping some file handle.
+        return str_ex->get_native_handle();
     }
     else
     {
-        // Parent
+        return -2;
+    }
+}
+
+bool Process::Start(const int fds[3], ostream& err)
+{
+    vector<const char*> args;
+    args.push_back(m_program.c_str());
+    for (const string& arg : m_args)
+    {
+        args.push_back(arg.c_str());
+    }
+    args.push_back(nullptr);
 
-        vector<pthread_t> threads;
-        pthread_t inThread, outThread, errThread;
+    const int closeFds[3] = { -1, -1, -1 };
+    m_pid = StartChild(m_program, m_path, args, fds, closeFds, err);
+    return m_pid != -1;
+}
 
-        WriteThreadArgs inThreadArgs;
-        ReadThreadArgs outThreadArgs, errThreadArgs;
+void Process::Wait(int* pExitCode)
+{
+    if (m_pid != -1 && !m_exited)
+    {
+        waitpid(m_pid, &m_exitCode, 0);
+        m_exited = true;
+    }
+    *pExitCode = m_exitCode;
+}
 
-        if (needs_io_thread)
+bool Process::Finished(int* pExitCode)
+{
+    if (m_pid != -1 && !m_exited)
+    {
+        int status;
+        if (waitpid(m_pid, &status, WNOHANG) == 0)
         {
-            // Start threads
-
-            auto createThread = [&threads](
-                auto* args,
-                pthread_t& thread,
-                ManagedHandle& fdThread,
-                ManagedHandle& fdChild,
-                auto* stream,
-                void*(*threadProc)(void*)
-                )
-            {
-                if (fdThread != -1)
-                {
-                    fdChild.Close();
-                    args->childHandle = addressof(fdThread);
-                    args->stream = stream;
-                    int result = pthread_create(&thread, nullptr, threadProc, args);
-                    if (result != 0)
-                    {
-                        cerr << "failed to create thread: " << strerror(errno) << endl;
-                    }
-                    threads.push_back(thread);
-                }
-            };
+            return false;
+        }
+        m_exitCode = status;
+        m_exited = true;
+    }
+    *pExitCode = m_exitCode;
+    return true;
+}
+
+int Process::ExitHandle()
+{
+#ifdef SYS_pidfd_open
+    if (m_pidFd == -1 && m_pid != -1 && !m_exited)
+    {
+        // It's close-on-exec already.
+        m_pidFd = static_cast<int>(syscall(SYS_pidfd_open, m_pid, 0));
+    }
+#endif
+    return m_pidFd;
+}
 
-            createThread(&inThreadArgs, inThread, fdThreadIn, fdIn, &in, WriteThreadProc);
-            createThread(&outThreadArgs, outThread, fdThreadOut, fdOut, &out, ReadThreadProc);
-            createThread(&errThreadArgs, errThread, fdThreadErr, fdErr, &err, ReadThreadProc);
+pid_t Process::Pid() const
+{
+    return m_pid;
+}
+
+void Process::Copy(int inFd, istream& in, int outFd, ostream& out, int errFd, ostream& err)
+{
+    thread_local IoReactor reactor;
+    reactor.Run(inFd, in, outFd, out, errFd, err);
+}
+
+void Process::Exec(istream& in, ostream& out, ostream& err)
+{
+    ios* streams[3] = { &in, &out, &err };
+    ios* stdStreams[3] = { &cin, &cout, &cerr };
+    int fds[3];
+    for (int i = 0; i < 3; i++)
+    {
+        fds[i] = StreamHandle(streams[i], stdStreams[i]);
+        if (fds[i] == -2)
+        {
+            return;
         }
-        else
+    }
+
+    vector<const char*> args;
+    args.push_back(m_program.c_str());
+    for (const string& arg : m_args)
+    {
+        args.push_back(arg.c_str());
+    }
+    args.push_back(nullptr);
+
+    // Anything the shell has written has to be out before the program's output.
+    out.flush();
+    err.flush();
+    cout.flush();
+    cerr.flush();
+
+    // Keep the shell's own descriptors, to put back if the program can't be run after all.
+    int saved[3] = { -1, -1, -1 };
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1 && fds[i] != i)
         {
-            fdIn.LeaveOpen();
-            fdOut.LeaveOpen();
-            fdErr.LeaveOpen();
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[i], i);
         }
+    }
+
+    signal(SIGPIPE, SIG_DFL);
 
-        waitpid(pid, pExitCode, 0);
+    if (m_path.empty())
+    {
+        execvp(m_program.c_str(), const_cast<char * const *>(&args[0]));
+    }
+    else
+    {
+        execv(m_path.c_str(), const_cast<char * const *>(&args[0]));
+    }
 
-        if (needs_io_thread)
+    int error = errno;
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < 3; i++)
+    {
+        if (saved[i] != -1)
         {
-            for (pthread_t thread : threads)
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+    errno = error;
+}
+
+bool Process::Run_Posix(istream& in, ostream& out, ostream& err, int *pExitCode)
+{
+    *pExitCode = -1;
+
+    ManagedHandle fdIn, fdOut, fdErr;
+    ManagedHandle fdCopyIn, fdCopyOut, fdCopyErr;
+    bool needs_copying = false;
+
+    auto fn = [&needs_copying](
+        ManagedHandle& childFd,
+        ManagedHandle& copyFd,
+        ManagedHandle& readFd,
+        ManagedHandle& writeFd,
+        ios* stream,
+        ios* stdStream,
+        int stdFd)
+    {
+        int handle = StreamHandle(stream, stdStream);
+        if (handle == -1)
+        {
+            // The child shares the shell's own output (or the console), which has to be up to
+            // date before the child writes to it.
+            if (stdFd != 0)
             {
-                pthread_join(thread, /* retval: */ nullptr);
+                stream->rdbuf()->pubsync();
             }
+            childFd = stdFd;
+            childFd.LeaveOpen();
+            copyFd = -1;
         }
+        else if (handle != -2)
+        {
+            // A file (e.g. from a redirection). Anything the shell has written to it has to be
+            // out before the child's output.
+            stream->rdbuf()->pubsync();
+            childFd = handle;
+            childFd.LeaveOpen();
+            copyFd = -1;
+        }
+        else
+        {
+            // It's some other kind of stream. The pipe is close-on-exec, so that programs started
+            // on other threads meanwhile don't keep it open.
+            needs_copying = true;
+            int fd[2];
+            pipe2(fd, O_CLOEXEC);
+            readFd = fd[0];
+            writeFd = fd[1];
+        }
+    };
 
-        return true;
+    // child  copy       read       write     stream  std    fd
+    fn(fdIn,  fdCopyIn,  fdIn,      fdCopyIn, &in,    &cin,  0);
+    fn(fdOut, fdCopyOut, fdCopyOut, fdOut,    &out,   &cout, 1);
+    fn(fdErr, fdCopyErr, fdCopyErr, fdErr,    &err,   &cerr, 2);
+
+    vector<const char*> args;
+    args.push_back(m_program.c_str());
+    for (const string& arg : m_args)
+    {
+        args.push_back(arg.c_str());
     }
+    args.push_back(nullptr);
 
-    return false;
+    // The child gets files and pipes straight from the descriptors; the standard streams are
+    // already where they need to be.
+    const int copyFds[3] = { fdCopyIn, fdCopyOut, fdCopyErr };
+    const int childFds[3] = { fdIn, fdOut, fdErr };
+
+    pid_t pid = StartChild(m_program, m_path, args, childFds, copyFds, err);
+    if (pid == -1)
+    {
+        return false;
+    }
+
+    if (needs_copying)
+    {
+        // Our copies of the child's ends have to be closed, or we'd never see the end of its
+        // output.
+        fdIn.Close();
+        fdOut.Close();
+        fdErr.Close();
+
+        Copy(fdCopyIn, in, fdCopyOut, out, fdCopyErr, err);
+        fdCopyIn.LeaveOpen();
+    }
+    else
+    {
+        fdIn.LeaveOpen();
+        fdOut.LeaveOpen();
+        fdErr.LeaveOpen();
+    }
+
+    waitpid(pid, pExitCode, 0);
+
+    return true;
 }
 
 #endif // _MSC_VER
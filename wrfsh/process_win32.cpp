@@ -219,6 +219,19 @@ DWORD WINAPI WriteThreadProc(LPVOID lpThreadParam)
     return 0;
 }
 
+bool Process::Find(const string& name, const string& /*search_path*/, string& full_path, bool& cacheable)
+{
+    // CreateProcess does its own search (which also tries extensions from PATHEXT).
+    full_path = name;
+    cacheable = false;
+    return true;
+}
+
+void Process::Exec(istream& /*in*/, ostream& /*out*/, ostream& /*err*/)
+{
+    // Windows has no way to replace a process with another one.
+}
+
 bool Process::Run_Win32(istream& in, ostream& out, ostream& err, int *pExitCode)
 {
     *pExitCode = -1;
@@ -1,8 +1,11 @@
+#include "unicodehack.h"
+
 #include <iostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <list>
+#include <map>
 #include <locale>
 #include <memory>
 #include <algorithm>
@@ -12,105 +15,14 @@
 #include "common.h"
 #include "global_state.h"
 #include "commandlets.h"
-#include "process.h"
 #include "repl.h"
+#include "expansion.h"
+#include "arithmetic.h"
+#include "script.h"
+#include "stream_ex.h"
 
 using namespace std;
 
-struct program_line
-{
-    string special;
-    string command;
-    vector<string> args;
-
-    program_line() :
-        special(),
-        command(),
-        args()
-    {
-        // ensure there's an empty arg to push characters onto
-        args.push_back("");
-    }
-
-    void reset()
-    {
-        special.clear();
-        command.clear();
-        args.clear();
-        args.emplace_back();
-    }
-
-    void print(ostream& out)
-    {
-        if (!special.empty())
-            out << "(" << special << ") ";
-        out << command << endl;
-        for (size_t i = 0, n = args.size(); i < n; i++)
-        {
-            if (!args[i].empty())
-            {
-                out << "\t" << i << ": " << args[i] << endl;
-            }
-        }
-    }
-
-    int execute(istream& in, ostream& out, ostream& err, global_state& global_state)
-    {
-        if ((global_state.if_state.size() != 0)
-            && !global_state.if_state.back().active
-            && (command != "else")
-            && (command != "endif"))
-        {
-            return 0;
-        }
-
-        vector<string> new_args;
-        bool args_processed = false;
-        if (command != "if" && command != "else") // these use the un-processed strings
-        {
-            // Do string interpolation, backtick expansion, etc.
-            for (const auto& arg : args)
-            {
-                new_args.push_back(process_expression(arg, global_state, in, err));
-            }
-            args_processed = true;
-            swap(args, new_args);
-        }
-
-        int retval;
-
-        auto pos = special_functions.find(command);
-        if (pos != special_functions.end())
-        {
-            retval = pos->second(in, out, err, global_state, args);
-        }
-        else
-        {
-            // Not a commandlet. Run the command.
-
-            Process p(command, args);
-            bool ok = p.Run(in, out, err, &retval);
-
-            if (!ok)
-            {
-                err << "process failed!\n";
-                retval = -1;
-                global_state.error = true;
-            }
-
-            // Save the return value as $?
-            global_state.let("?", to_string(retval));
-        }
-
-        if (args_processed)
-        {
-            swap(args, new_args);
-        }
-
-        return retval;
-    }
-};
-
 string process_expression(const string& expression, global_state& global_state, istream& in, ostream& err)
 {
     string result;
@@ -132,7 +44,7 @@ string process_expression(const string& expression, global_state& global_state,
             // $# = number of positional parameters
             // $* = positional parameters strung together as a single word
             // $@ = positional parameters *as separate words* (doesn't work yet)
-            // $! = PID of last job run in background (doesn't work yet)
+            // $! = PID of last job run in background
             // $_ = last positional parameter of previous command (doesn't work yet)
             // $? = exit status of previous command
             // $$ = current PID (doesn't work yet)
@@ -194,12 +106,23 @@ string process_expression(const string& expression, global_state& global_state,
                 string command_line = result.substr(bt_substitution_start_pos);
 
                 stringstream input(command_line);
-                stringstream output;
+                capture_buf buffer;
+                ostream output(&buffer);
                 int exitCode = repl(input, output, err, global_state, in);
 
-                global_state.let("?", to_string(exitCode));
+                global_state.let(global_state::status_slot, to_string(exitCode));
 
-                result.replace(bt_substitution_start_pos, result.size(), output.str());
+                string captured = buffer.take();
+                strip_trailing_newlines(captured);
+                if (bt_substitution_start_pos == 0)
+                {
+                    result = move(captured);
+                }
+                else
+                {
+                    result.resize(bt_substitution_start_pos);
+                    result.append(captured);
+                }
                 string_stack.pop_back();
             }
             else if (string_stack.empty() || string_stack.back() != '\'')
@@ -216,6 +139,16 @@ string process_expression(const string& expression, global_state& global_state,
         case '$':
             if ((string_stack.empty() || string_stack.back() != '\'') && !variable_pending)
             {
+                size_t end;
+                if (expression.compare(i, 3, "$((") == 0
+                    && (end = arithmetic::find_end(expression, i + 3)) != string::npos)
+                {
+                    arithmetic math(expression.substr(i + 3, end - i - 3));
+                    result.append(to_string(math.evaluate(global_state, err)));
+                    i = end + 1;
+                    break;
+                }
+
                 variable_pending = true;
                 var_substitution_start_pos = result.size();
             }
@@ -236,270 +169,62 @@ string process_expression(const string& expression, global_state& global_state,
     return result;
 }
 
-int repl(istream& in, ostream& out, ostream& err, global_state& global_state, istream& process_input)
+int repl(istream& in, ostream& out, ostream& err, global_state& global_state, istream& process_input, bool exec_last)
 {
     int exitCode = 0;
-    program_line command;
-
-    bool escape = false;
-
-    vector<char> string_stack;
-
-    bool in_comment = false;
+    script_parser parser(in);
 
-    enum class readstate
+    shared_ptr<script> program = move(global_state.pending_script);
+    if (program == nullptr)
     {
-        reading_command,
-        reading_args
-    };
-    readstate state = readstate::reading_command;
+        program = make_shared<script>();
+    }
 
+    // Run the input a block at a time, so large scripts don't have to be held in memory all at once.
     for (;;)
     {
-        char c;
-        in.get(c);
+        bool more = parser.parse_block(*program, err);
 
-        if (in.bad() && !in.eof())
-        {
-            err << "badbit on input\n";
-            exitCode = 1;
-        }
-        else if (in.fail() && !in.eof())
+        const char* open_block = program->open_block();
+        if (open_block != nullptr)
         {
-            err << "failbit on input\n";
-            exitCode = 2;
-        }
-        else
-        {
-            // Begin input parser state machine
-
-            if (in.eof())
+            if (more)
             {
-                // Add a newline in case EOF came at the end of a line.
-                // We'll terminate at the end of this loop iteration.
-                c = '\n';
-
-                // if input ended in '\', end the escape and force the line to be entered.
-                if (escape)
-                    escape = false;
-            }
-
-            if (in_comment && c != '\n')
-            {
-                // Comments continue to the end of the line.
+                // A loop has to be read all the way to its end before any of it can run.
                 continue;
             }
-
-            if (escape)
+            else if (global_state.interactive && parser.error() == 0)
             {
-                // special case: newline doesn't go to the argument unless it's inside a string
-                if (c == '\n' && string_stack.empty())
-                {
-                    c = ' ';
-                    escape = false;
-                }
-                else
-                {
-                    goto normal;
-                }
-            }
-
-            switch (c)
-            {
-            case '\r':
-                // Ignore.
-                break;
-
-            case '\n':
-                if (!command.command.empty() && (command.args.size() > 0) && command.args.back().empty())
-                {
-                    // Remove the empty last argument if present.
-                    command.args.pop_back();
-                }
-
-                if (!command.special.empty())
-                {
-                    int number = atoi(command.special.c_str());
-                    bool found = false;
-
-                    auto it = global_state.stored_program.begin();
-
-                    for (auto end = global_state.stored_program.end(); it != end; ++it)
-                    {
-                        int current = atoi(it->number.c_str());
-
-                        if (command.command.empty())
-                        {
-                            if (current == number)
-                            {
-                                global_state.stored_program.erase(it);
-                                break;
-                            }
-                        }
-                        else if (current == number)
-                        {
-                            it->command = move(command.command);
-                            it->args = move(command.args);
-                            found = true;
-                        }
-                        else if (current > number)
-                        {
-                            // Keep the current iterator position.
-                            break;
-                        }
-                    }
-
-                    if (!found && !command.command.empty())
-                    {
-                        global_state.stored_program.emplace(it, move(command.special), move(command.command), move(command.args));
-                    }
-
-                    command.reset();
-                    state = readstate::reading_command;
-                }
-                else if (!command.command.empty())
-                {
-                    //command.print(out); //DEBUG
-
-                    exitCode = command.execute(process_input, out, err, global_state);
-
-                    if (global_state.exit)
-                    {
-                        if (!global_state.error)
-                        {
-                            // Exit here.
-                            break;
-                        }
-                        else
-                        {
-                            global_state.exit = false;
-                        }
-                    }
-
-                    command.reset();
-                    state = readstate::reading_command;
-                }
-
-                if (in_comment)
-                {
-                    in_comment = false;
-                }
-                break;
-
-            case ' ':
-            case '\t':
-                if (string_stack.empty())
-                {
-                    if (state == readstate::reading_command && !command.command.empty())
-                    {
-                        state = readstate::reading_args;
-                    }
-                    else if (state == readstate::reading_args && !command.args.back().empty())
-                    {
-                        command.args.emplace_back();
-                    }
-                    break;
-                }
-                else
-                {
-                    goto normal;
-                }
-
-            case '#':
-                in_comment = true;
+                // Keep going with the next line of input.
+                global_state.pending_script = move(program);
                 break;
+            }
 
-            case '\'':
-                if (string_stack.empty())
-                {
-                    string_stack.push_back('\'');
-                }
-                else if (string_stack.back() == '\'')
-                {
-                    string_stack.pop_back();
-                }
-                goto normal;
-
-#define STRING_CASE(c) \
-            case c: \
-                if (!string_stack.empty() && string_stack.back() == c) \
-                { \
-                    string_stack.pop_back(); \
-                } \
-                else if (string_stack.empty() || string_stack.back() != '\'' ) \
-                { \
-                    string_stack.push_back(c); \
-                } \
-                goto normal \
-
-            STRING_CASE('"');
-            STRING_CASE('`');
-
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-                if (command.command.empty())
-                {
-                    command.special.push_back(c);
-                    break;
-                }
-                else
-                {
-                    goto normal;
-                }
+            err << "Syntax error: expected '" << open_block << "' before end of input\n";
+            global_state.error = true;
+            exitCode = -1;
+            break;
+        }
 
-            case '\\':
-                escape = true;
-                if (!command.special.empty())
-                {
-                    goto normal;
-                }
-                break;
+        exitCode = program->run(process_input, out, err, global_state, exitCode, 0, exec_last && !more && parser.error() == 0);
 
-            normal:
-            default:
-                if (state == readstate::reading_command)
-                {
-                    command.command.push_back(c);
-                }
-                else
-                {
-                    command.args.back().push_back(c);
-                }
+        if (global_state.exit || global_state.error)
+        {
+            break;
+        }
 
-                if (escape)
-                {
-                    escape = false;
-                }
-            } // end switch
+        if (!more)
+        {
+            break;
+        }
 
-            if (global_state.error)
-            {
-                if (!global_state.interactive)
-                {
-                    // Error in a non-interactive (batch) script.
-                    // Terminate now.
-                    break;
-                }
+        program = make_shared<script>();
+    }
 
-                // Error in an interactive session.
-                // Do not terminate; just clear the error and continue to read input.
-                global_state.error = false;
-            }
+    if (parser.error() != 0)
+    {
+        exitCode = parser.error();
+    }
 
-            if (in.eof() || global_state.exit)
-            {
-                // EOF or exit was hit this iteration, and handled above. Terminate the REPL now.
-                break;
-            }
-        }
-    } // for(;;)
     return exitCode;
 }
@@ -7,7 +7,8 @@ int repl(
     std::ostream& out,
     std::ostream& err,
     global_state& global_state,
-    std::istream& process_input
+    std::istream& process_input,
+    bool exec_last = false              // Nothing runs after this input; see script::run().
     );
 
 std::string process_expression(
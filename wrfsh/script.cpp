@@ -0,0 +1,976 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+
+#include <string.h>
+
+#include "common.h"
+#include "global_state.h"
+#include "commandlets.h"
+#include "expansion.h"
+#include "if_expression.h"
+#include "arithmetic.h"
+#include "script.h"
+
+using namespace std;
+
+script::script() :
+    m_code(),
+    m_strings(),
+    m_expansions(),
+    m_conditions(),
+    m_calculations(),
+    m_storedLines(),
+    m_blocks(),
+    m_labels()
+{
+}
+
+void script::add_label(int number)
+{
+    size_t loop_depth = 0;
+    for (const block& b : m_blocks)
+    {
+        if (b.start_pc != block::no_branch
+            && (m_code[b.start_pc].op == opcode::for_init || m_code[b.start_pc].op == opcode::foreach_init))
+        {
+            loop_depth++;
+        }
+    }
+
+    m_labels[number] = { m_code.size(), loop_depth };
+}
+
+bool script::find_line(int number, size_t& pc) const
+{
+    auto pos = m_labels.lower_bound(number);
+    if (pos == m_labels.end())
+    {
+        return false;
+    }
+
+    pc = pos->second.pc;
+    return true;
+}
+
+const char* script::open_block() const
+{
+    return m_blocks.empty() ? nullptr : m_blocks.back().end_command;
+}
+
+size_t script::add_string(string s)
+{
+    m_strings.push_back(move(s));
+    return m_strings.size() - 1;
+}
+
+bool script::needs_expansion(const string& arg)
+{
+    return arg.find_first_of("\"'`$\\") != string::npos;
+}
+
+void script::add_arg(string& arg, bool raw)
+{
+    if (!raw && needs_expansion(arg))
+    {
+        m_expansions.emplace_back(arg);
+        m_code.push_back({ opcode::expand, m_expansions.size() - 1, 0, nullptr });
+    }
+    else
+    {
+        m_code.push_back({ opcode::push, add_string(move(arg)), 0, nullptr });
+    }
+}
+
+void script::add_line(parsed_line& line)
+{
+    if (!line.special.empty())
+    {
+        m_storedLines.push_back(move(line));
+        m_code.push_back({ opcode::store, m_storedLines.size() - 1, 0, nullptr });
+        return;
+    }
+
+    if (line.command.empty())
+    {
+        return;
+    }
+
+    if (line.command == "endwhile" || line.command == "endfor" || line.command == "endforeach")
+    {
+        end_loop(line.command);
+    }
+    else if (line.command == "if" || line.command == "else" || line.command == "endif")
+    {
+        add_if(line);
+    }
+    else if (add_loop(line))
+    {
+        // The jumps are filled in when the loop is closed.
+    }
+    else if (line.command == "let"
+        && line.args.size() == 3
+        && line.args[1] == "="
+        && !needs_expansion(line.args[0]))
+    {
+        const string& value = line.args[2];
+        size_t slot = global_state::intern_var(line.args[0]);
+        if (value.compare(0, 3, "$((") == 0 && arithmetic::find_end(value, 3) == value.size() - 2)
+        {
+            // Assignment of an arithmetic result: the number is stored without going through text.
+            m_calculations.push_back({ slot, arithmetic(value.substr(3, value.size() - 5)) });
+            m_code.push_back({ opcode::assign_number, m_calculations.size() - 1, 0, nullptr });
+        }
+        else
+        {
+            // Simple assignment to a fixed variable name: write straight to its slot.
+            add_arg(line.args[2], false);
+            m_code.push_back({ opcode::assign, slot, 0, nullptr });
+        }
+    }
+    else if (!line.args.empty() && line.args.back() == "&")
+    {
+        line.args.pop_back();
+        add_pipeline(line, true);
+    }
+    else if (line.command == "|" || find(line.args.begin(), line.args.end(), "|") != line.args.end())
+    {
+        add_pipeline(line, false);
+    }
+    else
+    {
+        vector<redirection> redirections;
+        if (!take_redirections(line.args, redirections))
+        {
+            return;
+        }
+
+        for (string& arg : line.args)
+        {
+            add_arg(arg, false);
+        }
+        vector<size_t> fixups;
+        add_redirections(redirections, fixups);
+
+        auto pos = special_functions.find(line.command);
+        if (line.command == "goto")
+        {
+            m_code.push_back({ opcode::go, 0, 0, nullptr });
+        }
+        else if (line.command == "gosub")
+        {
+            m_code.push_back({ opcode::gosub, 0, 0, nullptr });
+        }
+        else if (line.command == "return")
+        {
+            m_code.push_back({ opcode::ret, 0, 0, nullptr });
+        }
+        else if (pos != special_functions.end())
+        {
+            m_code.push_back({ opcode::call, 0, 0, pos->second });
+        }
+        else
+        {
+            m_code.push_back({ opcode::exec, add_string(move(line.command)), 0, nullptr });
+        }
+
+        for (size_t pc : fixups)
+        {
+            m_code[pc].target = m_code.size();
+        }
+    }
+}
+
+void script::add_error(string message)
+{
+    m_code.push_back({ opcode::fail, add_string(move(message)), m_code.size() + 1, nullptr });
+}
+
+// Add an instruction that tests an if-expression and jumps to its target if it's false. If the
+// expression doesn't parse, the instruction reports the error instead, and then jumps.
+void script::add_condition(opcode op, const vector<string>& args)
+{
+    auto condition = make_shared<IfExpression::Expression>();
+    stringstream parse_err;
+    if (IfExpression::parse_if_expression(args, *condition, parse_err))
+    {
+        m_conditions.push_back(move(condition));
+        m_code.push_back({ op, m_conditions.size() - 1, 0, nullptr });
+    }
+    else
+    {
+        add_error(parse_err.str());
+    }
+}
+
+// Compile a line with pipes in it, or that ends with "&" (which has been taken off). The parser
+// leaves each pipe as a "|" argument, followed by the next command and its arguments. Each stage's
+// arguments are expanded in turn, and then the stages are all started at once.
+void script::add_pipeline(parsed_line& line, bool background)
+{
+    vector<parsed_line> stages(1);
+    if (line.command != "|")
+    {
+        stages[0].command = move(line.command);
+    }
+
+    for (string& arg : line.args)
+    {
+        if (arg == "|")
+        {
+            if (stages.back().command.empty())
+            {
+                break;
+            }
+            stages.emplace_back();
+        }
+        else if (stages.back().command.empty())
+        {
+            stages.back().command = move(arg);
+        }
+        else
+        {
+            stages.back().args.push_back(move(arg));
+        }
+    }
+
+    static const char* const not_commands[] =
+    {
+        "if", "else", "endif", "while", "endwhile", "for", "endfor", "foreach", "endforeach",
+        "goto", "gosub", "return", "exec",
+    };
+
+    vector<vector<redirection>> redirections(stages.size());
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        const parsed_line& stage = stages[i];
+        if (stage.command.empty())
+        {
+            add_error("Syntax error: missing command in pipeline\n");
+            return;
+        }
+        for (const char* keyword : not_commands)
+        {
+            if (stage.command == keyword)
+            {
+                add_error("Syntax error: " + stage.command + " can't be used in a pipeline\n");
+                return;
+            }
+        }
+
+        if (!take_redirections(stages[i].args, redirections[i]))
+        {
+            return;
+        }
+        if (background && special_functions.find(stage.command) != special_functions.end())
+        {
+            add_error("Syntax error: " + stage.command + " can't be run in the background\n");
+            return;
+        }
+
+        // The pipes take the place of the other stages' input and output. Errors from all the
+        // stages go to the same place, so they can only be redirected on the last one.
+        for (const redirection& r : redirections[i])
+        {
+            if (background && r.op == "<<<")
+            {
+                add_error("Syntax error: here-strings can't be used in the background\n");
+                return;
+            }
+
+            bool input = (r.op[0] == '<');
+            if (input ? (i > 0) : (i + 1 < stages.size()))
+            {
+                add_error(string("Syntax error: only the ") + (input ? "first" : "last")
+                    + " command in a pipeline can use " + r.op + "\n");
+                return;
+            }
+        }
+    }
+
+    vector<size_t> fixups;
+
+    for (size_t i = 0, n = stages.size(); i < n; i++)
+    {
+        for (string& arg : stages[i].args)
+        {
+            add_arg(arg, false);
+        }
+        add_redirections(redirections[i], fixups);
+
+        opcode op = (i + 1 < n) ? opcode::pipe : background ? opcode::spawn : opcode::pipe_run;
+        auto pos = special_functions.find(stages[i].command);
+        if (pos != special_functions.end())
+        {
+            m_code.push_back({ op, 0, 0, pos->second });
+        }
+        else
+        {
+            m_code.push_back({ op, add_string(move(stages[i].command)), 0, nullptr });
+        }
+    }
+
+    for (size_t pc : fixups)
+    {
+        m_code[pc].target = m_code.size();
+    }
+}
+
+// Take the redirections out of a command's arguments. The operator has to start a word, but it
+// can be a word of its own or written right before the file it applies to ("> $f" or ">$f");
+// quoting it makes it an ordinary argument. Returns false, after adding an error, if one is
+// missing its word.
+bool script::take_redirections(vector<string>& args, vector<redirection>& redirections)
+{
+    // Longer operators come first, so they're matched before their prefixes.
+    static const char* const operators[] = { "<<<", "2>&1", "2>>", "2>", ">>", ">", "<" };
+
+    size_t kept = 0;
+    for (size_t i = 0, n = args.size(); i < n; i++)
+    {
+        const char* op = nullptr;
+        for (const char* candidate : operators)
+        {
+            if (args[i].compare(0, strlen(candidate), candidate) == 0)
+            {
+                op = candidate;
+                break;
+            }
+        }
+
+        if (op == nullptr)
+        {
+            if (kept != i)
+            {
+                args[kept] = move(args[i]);
+            }
+            kept++;
+            continue;
+        }
+
+        string word = args[i].substr(strlen(op));
+        if (strcmp(op, "2>&1") == 0)
+        {
+            if (!word.empty())
+            {
+                add_error("Syntax error: unexpected \"" + word + "\" after 2>&1\n");
+                return false;
+            }
+        }
+        else if (word.empty())
+        {
+            if (i + 1 == n)
+            {
+                add_error(string("Syntax error: expected a word after ") + op + "\n");
+                return false;
+            }
+            word = move(args[++i]);
+        }
+        redirections.push_back({ op, move(word) });
+    }
+
+    args.resize(kept);
+    return true;
+}
+
+// Add the instructions for a command's redirections. These come after its arguments. The
+// instructions that need to skip past the command are added to fixups, for their targets to be
+// filled in once it's been added.
+void script::add_redirections(vector<redirection>& redirections, vector<size_t>& fixups)
+{
+    static const struct
+    {
+        const char* op;
+        redirect_mode mode;
+    } modes[] =
+    {
+        { "<", redirect_mode::input },
+        { ">", redirect_mode::output },
+        { ">>", redirect_mode::append },
+        { "2>", redirect_mode::error },
+        { "2>>", redirect_mode::error_append },
+        { "2>&1", redirect_mode::error_to_output },
+    };
+
+    for (redirection& r : redirections)
+    {
+        if (r.op == "<<<")
+        {
+            add_arg(r.word, false);
+            m_code.push_back({ opcode::here_string, 0, 0, nullptr });
+            continue;
+        }
+
+        redirect_mode mode = redirect_mode::input;
+        for (const auto& m : modes)
+        {
+            if (r.op == m.op)
+            {
+                mode = m.mode;
+                break;
+            }
+        }
+
+        if (mode != redirect_mode::error_to_output)
+        {
+            add_arg(r.word, false);
+        }
+        fixups.push_back(m_code.size());
+        m_code.push_back({ opcode::redirect, static_cast<size_t>(mode), 0, nullptr });
+    }
+}
+
+// Compile 'if', 'else if', 'else' and 'endif'. Every branch of an if block is laid out in order;
+// each condition jumps to the next branch if it's false, and the end of each branch jumps to the
+// endif. The jumps are filled in as the later parts are compiled.
+void script::add_if(parsed_line& line)
+{
+    if (line.command == "if")
+    {
+        add_condition(opcode::branch, line.args);
+        m_blocks.push_back({ "endif", m_code.size() - 1, {} });
+        return;
+    }
+
+    if (m_blocks.empty() || strcmp(m_blocks.back().end_command, "endif") != 0)
+    {
+        add_error("Syntax error: " + line.command + " without preceding if\n");
+        return;
+    }
+
+    block& b = m_blocks.back();
+
+    if (line.command == "else")
+    {
+        if (!line.args.empty() && line.args[0] != "if")
+        {
+            add_error("Syntax error: else does not take any arguments (except when of the form 'else if')\n");
+            return;
+        }
+        else if (b.start_pc == block::no_branch)
+        {
+            add_error("Syntax error: else after the final else of an if block\n");
+            return;
+        }
+
+        // The previous branch is done.
+        b.exits.push_back(m_code.size());
+        m_code.push_back({ opcode::jump, 0, 0, nullptr });
+        m_code[b.start_pc].target = m_code.size();
+
+        if (line.args.empty())
+        {
+            b.start_pc = block::no_branch;
+        }
+        else
+        {
+            line.args.erase(line.args.begin());
+            add_condition(opcode::branch, line.args);
+            b.start_pc = m_code.size() - 1;
+        }
+    }
+    else // endif
+    {
+        if (!line.args.empty())
+        {
+            add_error("Syntax error: endif does not take any arguments\n");
+            return;
+        }
+
+        size_t end = m_code.size();
+        m_code.push_back({ opcode::endif, 0, 0, nullptr });
+
+        if (b.start_pc != block::no_branch)
+        {
+            m_code[b.start_pc].target = end;
+        }
+        for (size_t exit : b.exits)
+        {
+            m_code[exit].target = end;
+        }
+
+        m_blocks.pop_back();
+    }
+}
+
+// Compile the start of a loop, if the line is one. The body is compiled like any other lines, and
+// end_loop() closes it and points the jumps at the right places.
+bool script::add_loop(parsed_line& line)
+{
+    const char* end_command;
+
+    if (line.command == "while")
+    {
+        // while <if-expression>
+        end_command = "endwhile";
+        add_condition(opcode::loop_while, line.args);
+    }
+    else if (line.command == "for")
+    {
+        // for <name> = <first> to <last> [step <step>]
+        end_command = "endfor";
+
+        auto& a = line.args;
+        if ((a.size() == 5 || (a.size() == 7 && a[5] == "step"))
+            && a[1] == "=" && a[3] == "to" && !needs_expansion(a[0]))
+        {
+            string step = (a.size() == 7) ? move(a[6]) : string("1");
+            add_arg(a[2], false);
+            add_arg(a[4], false);
+            add_arg(step, false);
+            m_code.push_back({ opcode::for_init, global_state::intern_var(a[0]), 0, nullptr });
+        }
+        else
+        {
+            add_error("Syntax error: expected 'for <name> = <first> to <last> [step <step>]'\n");
+        }
+    }
+    else if (line.command == "foreach")
+    {
+        // foreach <name> in <items...>
+        end_command = "endforeach";
+
+        auto& a = line.args;
+        if (a.size() >= 2 && a[1] == "in" && !needs_expansion(a[0]))
+        {
+            for (size_t i = 2; i < a.size(); i++)
+            {
+                add_arg(a[i], false);
+            }
+            m_code.push_back({ opcode::foreach_init, global_state::intern_var(a[0]), 0, nullptr });
+        }
+        else
+        {
+            add_error("Syntax error: expected 'foreach <name> in <items...>'\n");
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    // The loop starts with the instruction just added, after its arguments.
+    m_blocks.push_back({ end_command, m_code.size() - 1, {} });
+    return true;
+}
+
+void script::end_loop(const string& command)
+{
+    if (m_blocks.empty() || command != m_blocks.back().end_command)
+    {
+        add_error("Syntax error: " + command + " without preceding "
+            + command.substr(3) + "\n");
+        return;
+    }
+
+    block b = m_blocks.back();
+    m_blocks.pop_back();
+
+    switch (m_code[b.start_pc].op)
+    {
+    case opcode::loop_while:
+        m_code.push_back({ opcode::jump, 0, b.start_pc, nullptr });
+        break;
+    case opcode::for_init:
+        m_code.push_back({ opcode::for_next, 0, b.start_pc + 1, nullptr });
+        break;
+    case opcode::foreach_init:
+        m_code.push_back({ opcode::foreach_next, 0, b.start_pc + 1, nullptr });
+        break;
+    default:
+        // The start of the loop was a syntax error; it skips straight past here.
+        break;
+    }
+
+    m_code[b.start_pc].target = m_code.size();
+}
+
+namespace
+{
+    // Characters that can change the parser state. Everything else is appended to the current
+    // command or argument as-is, so runs of them can be copied in bulk.
+    struct significant_chars
+    {
+        bool table[256];
+
+        significant_chars() : table()
+        {
+            for (unsigned char c : { '\t', '\n', '\r', ' ', '"', '#', '\'', '(', ')', '\\', '`', '|' })
+            {
+                table[c] = true;
+            }
+        }
+
+        bool operator[](char c) const
+        {
+            return table[static_cast<unsigned char>(c)];
+        }
+    };
+
+    const significant_chars s_significant;
+
+    // Find the first significant character in [p, end), or return end.
+    //
+    // This looks at 8 bytes at a time: a word can only contain a significant character if it has
+    // a byte below 0x2A (which covers tab, newline, CR, space, the quote and comment characters,
+    // and parentheses), or a '\\', '`' or '|'. Only words that pass that test are checked byte by
+    // byte.
+    const char* find_significant(const char* p, const char* end)
+    {
+        const uint64_t ones = 0x0101010101010101ull;
+        const uint64_t highs = 0x8080808080808080ull;
+
+        auto has_less = [&](uint64_t x, uint64_t n)
+        {
+            return ((x - ones * n) & ~x & highs) != 0;
+        };
+
+        auto has_byte = [&](uint64_t x, uint64_t b)
+        {
+            uint64_t y = x ^ (ones * b);
+            return ((y - ones) & ~y & highs) != 0;
+        };
+
+        while (end - p >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+
+            if (has_less(word, 0x2A) || has_byte(word, '\\') || has_byte(word, '`') || has_byte(word, '|'))
+            {
+                for (const char* q = p, *q_end = p + 8; q != q_end; ++q)
+                {
+                    if (s_significant[*q])
+                    {
+                        return q;
+                    }
+                }
+            }
+            p += 8;
+        }
+
+        while (p != end && !s_significant[*p])
+        {
+            ++p;
+        }
+        return p;
+    }
+
+}
+
+script_parser::script_parser(istream& in) :
+    m_in(in),
+    m_program(nullptr),
+    m_error(0),
+    m_command(),
+    m_escape(false),
+    m_stringStack(),
+    m_inComment(false),
+    m_afterPipe(false),
+    m_state(readstate::reading_command)
+{
+    m_command.args.emplace_back();
+}
+
+int script_parser::error() const
+{
+    return m_error;
+}
+
+bool script_parser::parse_block(script& program, ostream& err)
+{
+    char buffer[64 * 1024];
+
+    m_program = &program;
+
+    m_in.read(buffer, sizeof(buffer));
+
+    if (m_in.bad() && !m_in.eof())
+    {
+        err << "badbit on input\n";
+        m_error = 1;
+        return false;
+    }
+    else if (m_in.fail() && !m_in.eof())
+    {
+        err << "failbit on input\n";
+        m_error = 2;
+        return false;
+    }
+
+    put(buffer, buffer + m_in.gcount());
+
+    if (m_in.eof())
+    {
+        // if input ended in '\\', end the escape and force the line to be entered.
+        m_escape = false;
+
+        // Add a newline in case EOF came at the end of a line.
+        put_char('\n');
+        return false;
+    }
+
+    return true;
+}
+
+void script_parser::put(const char* p, const char* end)
+{
+    while (p != end)
+    {
+        if (m_inComment)
+        {
+            // Comments continue to the end of the line.
+            auto newline = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (newline == nullptr)
+            {
+                return;
+            }
+            p = newline;
+        }
+        else if (!m_escape && !m_command.command.empty())
+        {
+            // Fast path: copy everything up to the next significant character.
+            const char* next = find_significant(p, end);
+            if (next != p)
+            {
+                current_string().append(p, next);
+                m_afterPipe = false;
+                p = next;
+                continue;
+            }
+        }
+
+        put_char(*p++);
+    }
+}
+
+string& script_parser::current_string()
+{
+    if (m_state == readstate::reading_command)
+    {
+        return m_command.command;
+    }
+    else
+    {
+        return m_command.args.back();
+    }
+}
+
+void script_parser::put_char(char c)
+{
+    if (m_inComment && c != '\n')
+    {
+        return;
+    }
+
+    const bool afterPipe = m_afterPipe;
+    m_afterPipe = false;
+
+    if (m_escape)
+    {
+        // special case: newline doesn't go to the argument unless it's inside a string
+        if (c == '\n' && m_stringStack.empty())
+        {
+            c = ' ';
+            m_escape = false;
+        }
+        else
+        {
+            goto normal;
+        }
+    }
+
+    switch (c)
+    {
+    case '\r':
+        // Ignore.
+        break;
+
+    case '\n':
+        // An unclosed $(( doesn't carry on to the next line.
+        while (!m_stringStack.empty() && m_stringStack.back() == '(')
+        {
+            m_stringStack.pop_back();
+        }
+
+        if (!m_command.command.empty() && (m_command.args.size() > 0) && m_command.args.back().empty())
+        {
+            // Remove the empty last argument if present.
+            m_command.args.pop_back();
+        }
+
+        if (!m_command.special.empty() || !m_command.command.empty())
+        {
+            m_program->add_line(m_command);
+
+            m_command.special.clear();
+            m_command.command.clear();
+            m_command.args.clear();
+            m_command.args.emplace_back();
+            m_state = readstate::reading_command;
+        }
+
+        m_inComment = false;
+        break;
+
+    case ' ':
+    case '\t':
+        if (m_stringStack.empty())
+        {
+            if (m_state == readstate::reading_command && !m_command.command.empty())
+            {
+                m_state = readstate::reading_args;
+            }
+            else if (m_state == readstate::reading_args && !m_command.args.back().empty())
+            {
+                m_command.args.emplace_back();
+            }
+            break;
+        }
+        else
+        {
+            goto normal;
+        }
+
+    case '#':
+        if (!m_stringStack.empty() && m_stringStack.back() == '(')
+        {
+            // Inside $(( )), as in $#.
+            goto normal;
+        }
+        m_inComment = true;
+        break;
+
+    case '(':
+        // $(( )) is read as one argument, spaces and all, up to the matching "))". Each
+        // parenthesis inside it is tracked on the string stack.
+        if (m_stringStack.empty() || m_stringStack.back() != '\'')
+        {
+            const string& s = current_string();
+            if (!m_stringStack.empty() && m_stringStack.back() == '(')
+            {
+                m_stringStack.push_back('(');
+            }
+            else if (s.size() >= 2 && s.compare(s.size() - 2, 2, "$(") == 0)
+            {
+                m_stringStack.push_back('(');
+                m_stringStack.push_back('(');
+            }
+        }
+        goto normal;
+
+    case ')':
+        if (!m_stringStack.empty() && m_stringStack.back() == '(')
+        {
+            m_stringStack.pop_back();
+        }
+        goto normal;
+
+    case '|':
+        if (!m_stringStack.empty())
+        {
+            goto normal;
+        }
+
+        // A pipe is kept as a "|" argument of its own, and whatever follows it is the next
+        // command, as more arguments. Two together are "||", for if-expressions.
+        if (afterPipe)
+        {
+            m_command.args.pop_back();
+            m_command.args.back().push_back('|');
+            m_command.args.emplace_back();
+            break;
+        }
+
+        if (m_state == readstate::reading_command)
+        {
+            if (m_command.command.empty())
+            {
+                // Nothing before the pipe. Let the compiler report it.
+                m_command.command = "|";
+            }
+            m_state = readstate::reading_args;
+        }
+
+        if (!m_command.args.back().empty())
+        {
+            m_command.args.emplace_back();
+        }
+        m_command.args.back() = "|";
+        m_command.args.emplace_back();
+        m_afterPipe = true;
+        break;
+
+    case '\'':
+        if (m_stringStack.empty())
+        {
+            m_stringStack.push_back('\'');
+        }
+        else if (m_stringStack.back() == '\'')
+        {
+            m_stringStack.pop_back();
+        }
+        goto normal;
+
+#define STRING_CASE(c) \
+    case c: \
+        if (!m_stringStack.empty() && m_stringStack.back() == c) \
+        { \
+            m_stringStack.pop_back(); \
+        } \
+        else if (m_stringStack.empty() || m_stringStack.back() != '\'' ) \
+        { \
+            m_stringStack.push_back(c); \
+        } \
+        goto normal \
+
+    STRING_CASE('"');
+    STRING_CASE('`');
+
+#undef STRING_CASE
+
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        if (m_command.command.empty())
+        {
+            m_command.special.push_back(c);
+            break;
+        }
+        else
+        {
+            goto normal;
+        }
+
+    case '\\':
+        m_escape = true;
+        if (!m_command.special.empty())
+        {
+            goto normal;
+        }
+        break;
+
+    normal:
+    default:
+        current_string().push_back(c);
+
+        if (m_escape)
+        {
+            m_escape = false;
+        }
+    } // end switch
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+class global_state;
+
+namespace IfExpression
+{
+    struct Expression;
+}
+
+// One line of input as read by the parser: an optional line number, the command name, and the
+// arguments exactly as written (quotes, variables and backticks have not been processed yet).
+struct parsed_line
+{
+    std::string special;
+    std::string command;
+    std::vector<std::string> args;
+};
+
+enum class opcode
+{
+    push,       // Push a string onto the argument list as-is.
+    expand,     // Evaluate an expansion and push the result onto the argument list.
+    call,       // Call a commandlet with the argument list, then clear it.
+    assign,     // Set a variable (by slot) to the last argument, then clear the argument list.
+    assign_number,  // Set a variable to the result of an arithmetic expression (by index).
+    exec,       // Run an external program with the argument list, then clear it.
+    store,      // Add, replace, or remove a numbered line in the stored program.
+    jump,       // Continue at the target.
+    branch,     // Evaluate an if condition (by index); skip to the target (the next branch of the
+                // if block) if false.
+    endif,      // End of an if block.
+    fail,       // Report a syntax error (by string) found while compiling, and skip to the target.
+    loop_while, // Evaluate a condition (by index); skip to the target (the end of the loop) if false.
+    for_init,   // Start a counted loop over a variable (by slot), taking the first, last and step
+                // values from the argument list. Skips to the target if the range is empty.
+    for_next,   // Step the innermost counted loop and continue at the target (the top of the
+                // body), or fall out of the loop once the range is done.
+    foreach_init,   // Start a loop over a variable (by slot), taking the items from the argument
+                    // list. Skips to the target if there are none.
+    foreach_next,   // Move the innermost foreach loop along, like for_next.
+    go,         // Jump to the line number given by the argument list (goto).
+    gosub,      // Like go, but remember where to return to.
+    ret,        // Return to after the last gosub.
+    pipe,       // Add a pipeline stage: the commandlet, or if there isn't one, the external program
+                // (by string), with the argument list. Then clear the argument list.
+    pipe_run,   // Add the last stage of a pipeline like pipe, then run all the stages together.
+    spawn,      // Like pipe_run, but start the stages in the background as a job ('cmd &').
+    here_string,    // Take the last argument off the list, plus a newline, as the input for the
+                    // next command.
+    redirect,   // Open a file (the last argument, taken off the list) for the next command's
+                // input or output, as given by the operand (a redirect_mode). If it can't be
+                // opened, report it and skip to the target (after the command).
+};
+
+enum class redirect_mode
+{
+    input,              // < file
+    output,             // > file
+    append,             // >> file
+    error,              // 2> file
+    error_append,       // 2>> file
+    error_to_output,    // 2>&1 (no file): errors go wherever the output goes.
+};
+
+struct instruction
+{
+    opcode op;
+    size_t operand;                     // Index into the string table, expansions, conditions, or
+                                        // stored lines, or a variable slot.
+    size_t target;                      // Jump target (index into the code).
+    commandlet_function commandlet;
+};
+
+// A script compiled into a flat instruction stream. Lines are parsed once (by script_parser) and
+// can then be run any number of times.
+class script
+{
+public:
+    script();
+
+    // Append one parsed line to the program.
+    void add_line(parsed_line& line);
+
+    // Give the next line added a line number, so it can be the target of goto and gosub.
+    void add_label(int number);
+
+    // Find where the first line numbered at least 'number' starts. Returns false if there isn't
+    // one.
+    bool find_line(int number, size_t& pc) const;
+
+    // If the program ends inside a loop or if block, the command that would close it; otherwise null.
+    // A program shouldn't be run until all its blocks are closed.
+    const char* open_block() const;
+
+    // Run the program, optionally starting partway through. Returns the exit code of the last
+    // command run, or exitCode if there wasn't one.
+    //
+    // If exec_last is true, nothing else is going to run after the program, so if it ends with an
+    // external command, that command replaces the shell instead of being waited for (when its
+    // input and output allow it; see Process::Exec()).
+    int run(std::istream& in, std::ostream& out, std::ostream& err, global_state& global_state, int exitCode = 0, size_t start = 0, bool exec_last = false) const;
+
+private:
+    static bool needs_expansion(const std::string& arg);
+    void add_arg(std::string& arg, bool raw);
+    size_t add_string(std::string s);
+    void add_error(std::string message);
+    void add_condition(opcode op, const std::vector<std::string>& args);
+    void add_if(parsed_line& line);
+    void add_pipeline(parsed_line& line, bool background);
+
+    // A redirection of a command's input or output, such as "> file" or "<<< word" (a
+    // here-string).
+    struct redirection
+    {
+        std::string op;
+        std::string word;
+    };
+    bool take_redirections(std::vector<std::string>& args, std::vector<redirection>& redirections);
+    void add_redirections(std::vector<redirection>& redirections, std::vector<size_t>& fixups);
+    bool add_loop(parsed_line& line);
+    void end_loop(const std::string& command);
+
+    std::vector<instruction> m_code;
+    std::vector<std::string> m_strings;
+    std::vector<expansion> m_expansions;
+    std::vector<std::shared_ptr<IfExpression::Expression>> m_conditions;
+
+    // 'let <name> = $(( ... ))': the variable and the expression.
+    struct calculation
+    {
+        size_t slot;
+        arithmetic expression;
+    };
+    std::vector<calculation> m_calculations;
+
+    std::vector<parsed_line> m_storedLines;
+
+    // If blocks and loops that have been started but not closed yet.
+    struct block
+    {
+        static const size_t no_branch = static_cast<size_t>(-1);
+
+        const char* end_command;
+        size_t start_pc;                // The instruction that starts the loop, or the if block's
+                                        // latest condition (no_branch after 'else').
+        std::vector<size_t> exits;      // If blocks: the jumps to the endif at the end of each branch.
+    };
+    std::vector<block> m_blocks;
+
+    // Numbered lines. Jumping to one has to leave the loops that it isn't inside, so it also
+    // records how deeply nested it is. (Only for and foreach loops keep state while running.)
+    struct label
+    {
+        size_t pc;
+        size_t loop_depth;
+    };
+    std::map<int, label> m_labels;
+};
+
+// Reads script text from a stream in large blocks and compiles it into a script, line by line.
+class script_parser
+{
+public:
+    script_parser(std::istream& in);
+
+    // Read the next block of input, and add every line it completes to the program.
+    // Returns false once the end of the input is reached, or if there was an error reading it.
+    bool parse_block(script& program, std::ostream& err);
+
+    // Nonzero if there was an error reading the input.
+    int error() const;
+
+private:
+    void put(const char* p, const char* end);
+    void put_char(char c);
+    std::string& current_string();
+
+    std::istream& m_in;
+    script* m_program;
+    int m_error;
+
+    parsed_line m_command;
+    bool m_escape;
+    std::vector<char> m_stringStack;
+    bool m_inComment;
+    bool m_afterPipe;                   // The last character was a pipe.
+
+    enum class readstate
+    {
+        reading_command,
+        reading_args
+    };
+    readstate m_state;
+};
@@ -1,6 +1,10 @@
 #include "unicodehack.h"
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 
 #include <assert.h>
 
@@ -46,39 +50,46 @@ stream_ex::stream_ex(native_string_t path, std::ios_base::openmode mode)
     {
         access |= GENERIC_READ;
     }
-    if (mode & std::ios_base::out)
+    if (mode & std::ios_base::app)
+    {
+        access |= FILE_APPEND_DATA;
+    }
+    else if (mode & std::ios_base::out)
     {
         access |= GENERIC_WRITE;
     }
 
-    DWORD creationDisposition = OPEN_ALWAYS;
+    DWORD creationDisposition = OPEN_EXISTING;
     if (mode & std::ios_base::trunc)
     {
-        creationDisposition |= TRUNCATE_EXISTING;
+        creationDisposition = CREATE_ALWAYS;
+    }
+    else if (mode & std::ios_base::out)
+    {
+        creationDisposition = OPEN_ALWAYS;
     }
 
     m_handle = CreateFileW(path.c_str(), access, FILE_SHARE_READ, nullptr, creationDisposition, FILE_ATTRIBUTE_NORMAL, NULL);
 
 #else
-    // UNTESTED!
-
-    mode_t imode = 0;
+    // Close-on-exec, so that child processes only get it if they're given it as one of their
+    // standard streams.
+    int flags = O_CLOEXEC;
 
     std::ios_base::openmode rwmode = mode & (std::ios_base::in | std::ios_base::out);
     if (rwmode == std::ios_base::in)
     {
-        imode = O_RDONLY;
+        flags |= O_RDONLY;
     }
     else if (rwmode == std::ios_base::out)
     {
-        imode = O_WRONLY;
+        flags |= O_WRONLY | O_CREAT;
     }
     else
     {
-        imode = O_RDWR;
+        flags |= O_RDWR | O_CREAT;
     }
 
-    int flags = O_CREAT;
     if (mode & std::ios_base::trunc)
     {
         flags |= O_TRUNC;
@@ -88,7 +99,7 @@ stream_ex::stream_ex(native_string_t path, std::ios_base::openmode mode)
         flags |= O_APPEND;
     }
 
-    m_handle = open(path.c_str(), flags, imode);
+    m_handle = open(path.c_str(), flags, 0666);
 #endif
 
     open_native_handle(mode);
@@ -97,6 +108,13 @@ stream_ex::stream_ex(native_string_t path, std::ios_base::openmode mode)
 void stream_ex::open_native_handle(std::ios_base::openmode mode)
 {
 #ifdef _MSC_VER
+    if (m_handle == INVALID_HANDLE_VALUE)
+    {
+        // Opening the file failed; leave the stream closed.
+        m_stream = new std::fstream();
+        return;
+    }
+
     int fd = _open_osfhandle(reinterpret_cast<intptr_t>(m_handle), 0);
     if (fd == -1)
     {
@@ -127,6 +145,14 @@ void stream_ex::open_native_handle(std::ios_base::openmode mode)
     m_stream = new std::fstream(file);
 #else
 #ifdef __GNUC__
+    if (m_handle == -1)
+    {
+        // Opening the file failed; leave the stream closed.
+        m_filebuf = nullptr;
+        m_stream = new std::iostream(nullptr);
+        return;
+    }
+
     // UNTESTED!
     m_filebuf = new __gnu_cxx::stdio_filebuf<char>(m_handle, mode);
     m_stream = new std::iostream(m_filebuf);
@@ -183,6 +209,15 @@ bool stream_ex::operator==(const stream_ex & other)
     }
 }
 
+bool stream_ex::is_open() const
+{
+#ifdef _MSC_VER
+    return (m_kind == kind::IOS) || (m_handle != INVALID_HANDLE_VALUE);
+#else
+    return (m_kind == kind::IOS) || (m_handle != -1);
+#endif
+}
+
 stream_ex::native_handle stream_ex::get_native_handle() const
 {
     if (m_kind == kind::Native)
@@ -229,8 +264,71 @@ ostream_ex::ostream_ex(native_handle handle)
 {
 }
 
-ostream_ex::ostream_ex(native_string_t path)
-    : stream_ex(path, std::ios_base::out)
+ostream_ex::ostream_ex(native_string_t path, std::ios_base::openmode mode)
+    : stream_ex(path, mode)
     , std::ostream(m_stream->rdbuf())
 {
 }
+
+capture_buf::capture_buf()
+    : m_data()
+{
+    setp(nullptr, nullptr);
+}
+
+char* capture_buf::reserve(size_t n)
+{
+    if (static_cast<size_t>(epptr() - pptr()) < n)
+    {
+        grow(n);
+    }
+    return pptr();
+}
+
+void capture_buf::commit(size_t n)
+{
+    // pbump() only takes an int.
+    while (n > 0)
+    {
+        int step = static_cast<int>(std::min<size_t>(n, INT_MAX));
+        pbump(step);
+        n -= step;
+    }
+}
+
+std::string capture_buf::take()
+{
+    m_data.resize(pptr() - pbase());
+    setp(nullptr, nullptr);
+    return std::move(m_data);
+}
+
+capture_buf::int_type capture_buf::overflow(int_type c)
+{
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        return traits_type::not_eof(c);
+    }
+
+    grow(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize capture_buf::xsputn(const char* s, std::streamsize n)
+{
+    memcpy(reserve(static_cast<size_t>(n)), s, static_cast<size_t>(n));
+    commit(static_cast<size_t>(n));
+    return n;
+}
+
+void capture_buf::grow(size_t needed)
+{
+    // At least double it, so that a long run of small writes is copied a bounded number of times.
+    size_t used = pptr() - pbase();
+    size_t capacity = std::max(std::max(m_data.size() * 2, used + needed), static_cast<size_t>(256));
+    m_data.resize(capacity);
+    setp(&m_data[0], &m_data[0] + capacity);
+    commit(used);
+}
@@ -18,6 +18,10 @@ public:
 
     native_handle get_native_handle() const;
 
+    // False if it was made from a path that couldn't be opened (errno, or GetLastError() on Windows,
+    // says why).
+    bool is_open() const;
+
 protected:
 
     enum class kind
@@ -55,5 +59,31 @@ class ostream_ex : public stream_ex, public std::ostream
 public:
     ostream_ex(std::ostream* stream);
     ostream_ex(native_handle handle);
-    ostream_ex(native_string_t path);
+    ostream_ex(native_string_t path, std::ios_base::openmode mode = std::ios_base::out | std::ios_base::trunc);
+};
+
+// A stream buffer that collects everything written to it in a string, for capturing the output of
+// commands. The string grows geometrically, and what's been written can be taken out without
+// copying it.
+class capture_buf : public std::streambuf
+{
+public:
+    capture_buf();
+
+    // Make room for at least n more bytes and return where they go, for writing to directly (e.g.
+    // with read()). commit() then says how many were written.
+    char* reserve(size_t n);
+    void commit(size_t n);
+
+    // Take everything written so far, leaving the buffer empty.
+    std::string take();
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+private:
+    void grow(size_t needed);
+
+    std::string m_data;                 // What's been written, then spare room up to its size.
 };
@@ -173,5 +173,6 @@ return s;
 #define ospath(_s) ((native_string_t)(_s))
 
 #define Narrow(_s) (_s)
+#define Widen(_s) (_s)
 
 #endif
@@ -0,0 +1,512 @@
+#include "unicodehack.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "global_state.h"
+#include "commandlets.h"
+#include "process.h"
+#include "pipeline.h"
+#include "stream_ex.h"
+#include "expansion.h"
+#include "if_expression.h"
+#include "arithmetic.h"
+#include "script.h"
+
+using namespace std;
+
+static void store_program_line(global_state& global_state, parsed_line line)
+{
+    int number = atoi(line.special.c_str());
+
+    if (line.command.empty())
+    {
+        global_state.stored_program.erase(number);
+    }
+    else
+    {
+        global_state.stored_program[number] = { move(line.command), move(line.args) };
+    }
+
+    // It'll be compiled again the next time it's run.
+    global_state.stored_program_script = nullptr;
+}
+
+static bool parse_number(const string& s, long long& value)
+{
+    char* end;
+    errno = 0;
+    value = strtoll(s.c_str(), &end, 10);
+    return !s.empty() && *end == '\0' && errno == 0;
+}
+
+namespace
+{
+    // State of a for or foreach loop that's running.
+    struct loop_frame
+    {
+        size_t slot;
+
+        // for: the current value, and where it stops. The range isn't expanded into a list.
+        long long current;
+        long long last;
+        long long step;
+
+        // foreach: the items, and the one the variable is set to.
+        vector<string> items;
+        size_t index;
+    };
+
+    // Where the next command's input and output go, if it has redirections.
+    struct redirections
+    {
+        unique_ptr<istream> in;
+        unique_ptr<ostream> out;
+        unique_ptr<ostream> err;
+        bool err_to_out = false;
+
+        // The streams the command uses, given the ones it would use otherwise.
+        istream& input(istream& in) const
+        {
+            return (this->in != nullptr) ? *this->in : in;
+        }
+
+        ostream& output(ostream& out) const
+        {
+            return (this->out != nullptr) ? *this->out : out;
+        }
+
+        ostream& errors(ostream& out, ostream& err) const
+        {
+            return err_to_out ? output(out) : (this->err != nullptr) ? *this->err : err;
+        }
+    };
+}
+
+// Open the file for a redirection. Output to /dev/null from a commandlet goes nowhere, without
+// even being written. Returns false if it couldn't be opened.
+static bool open_redirection(redirect_mode mode, const string& path, bool commandlet, redirections& r, ostream& err)
+{
+    if (mode == redirect_mode::error_to_output)
+    {
+        r.err = nullptr;
+        r.err_to_out = true;
+        return true;
+    }
+
+    unique_ptr<ostream>& target = (mode == redirect_mode::output || mode == redirect_mode::append) ? r.out : r.err;
+    if (mode == redirect_mode::error || mode == redirect_mode::error_append)
+    {
+        r.err_to_out = false;
+    }
+
+    if (mode != redirect_mode::input && commandlet && path == "/dev/null")
+    {
+        target = make_unique<ostream>(nullptr);
+        return true;
+    }
+
+    const bool append = (mode == redirect_mode::append || mode == redirect_mode::error_append);
+    stream_ex* stream;
+    if (mode == redirect_mode::input)
+    {
+        auto file = make_unique<istream_ex>(ospath(path));
+        stream = file.get();
+        r.in = move(file);
+    }
+    else
+    {
+        auto file = make_unique<ostream_ex>(ospath(path), append ? ios_base::out | ios_base::app : ios_base::out | ios_base::trunc);
+        stream = file.get();
+        target = move(file);
+    }
+
+    if (!stream->is_open())
+    {
+        err << "Error: can't open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+int script::run(istream& in, ostream& out, ostream& err, global_state& global_state, int exitCode, size_t start, bool exec_last) const
+{
+    vector<string> args;
+    vector<loop_frame> loops;
+    vector<size_t> returns;
+    vector<pipeline_stage> stages;
+
+    redirections redirect;
+
+    for (size_t pc = start, n = m_code.size(); pc < n; pc++)
+    {
+        const instruction& insn = m_code[pc];
+
+        switch (insn.op)
+        {
+        case opcode::push:
+            args.push_back(m_strings[insn.operand]);
+            continue;
+
+        case opcode::expand:
+            // Do string interpolation, backtick expansion, etc.
+            args.push_back(m_expansions[insn.operand].evaluate(global_state, in, err));
+            continue;
+
+        case opcode::store:
+            store_program_line(global_state, m_storedLines[insn.operand]);
+            continue;
+
+        case opcode::jump:
+            pc = insn.target - 1;
+            continue;
+
+        case opcode::fail:
+            err << m_strings[insn.operand];
+            global_state.error = true;
+            exitCode = -1;
+            pc = insn.target - 1;
+            break;
+
+        case opcode::branch:
+            // An error in the condition counts as false.
+            exitCode = 0;
+            if (!m_conditions[insn.operand]->evaluate(in, out, err, global_state) || global_state.error)
+            {
+                if (global_state.error)
+                {
+                    exitCode = -1;
+                }
+                pc = insn.target - 1;
+            }
+            break;
+
+        case opcode::endif:
+            exitCode = 0;
+            continue;
+
+        case opcode::loop_while:
+            exitCode = 0;
+            if (!m_conditions[insn.operand]->evaluate(in, out, err, global_state) || global_state.error)
+            {
+                if (global_state.error)
+                {
+                    exitCode = -1;
+                }
+                pc = insn.target - 1;
+            }
+            break;
+
+        case opcode::for_init:
+        {
+            loop_frame loop = { insn.operand, 0, 0, 0, {}, 0 };
+            exitCode = 0;
+            if (!parse_number(args[0], loop.current)
+                || !parse_number(args[1], loop.last)
+                || !parse_number(args[2], loop.step))
+            {
+                err << "Syntax error: 'for' needs whole numbers, not \"" << args[0] << "\" to \"" << args[1]
+                    << "\" step \"" << args[2] << "\"\n";
+                global_state.error = true;
+                exitCode = -1;
+                pc = insn.target - 1;
+            }
+            else if (loop.step == 0)
+            {
+                err << "Syntax error: 'for' step can't be zero\n";
+                global_state.error = true;
+                exitCode = -1;
+                pc = insn.target - 1;
+            }
+            else if (loop.step > 0 ? loop.current > loop.last : loop.current < loop.last)
+            {
+                pc = insn.target - 1;
+            }
+            else
+            {
+                global_state.let_number(loop.slot, loop.current);
+                loops.push_back(move(loop));
+            }
+            break;
+        }
+
+        case opcode::for_next:
+        {
+            loop_frame& loop = loops.back();
+            if (loop.step > 0 ? loop.current > loop.last - loop.step : loop.current < loop.last - loop.step)
+            {
+                loops.pop_back();
+            }
+            else
+            {
+                loop.current += loop.step;
+                global_state.let_number(loop.slot, loop.current);
+                pc = insn.target - 1;
+            }
+            continue;
+        }
+
+        case opcode::foreach_init:
+        {
+            // Each argument is an item, except that multi-line values (such as the output of a
+            // backtick command) are split into one item per line.
+            loop_frame loop = { insn.operand, 0, 0, 0, {}, 0 };
+            for (string& arg : args)
+            {
+                if (arg.find('\n') == string::npos)
+                {
+                    loop.items.push_back(move(arg));
+                    continue;
+                }
+
+                size_t start = 0;
+                while (start < arg.size())
+                {
+                    size_t end = arg.find('\n', start);
+                    if (end == string::npos)
+                    {
+                        end = arg.size();
+                    }
+
+                    size_t len = end - start;
+                    if (len > 0 && arg[end - 1] == '\r')
+                    {
+                        len--;
+                    }
+                    if (len > 0)
+                    {
+                        loop.items.push_back(arg.substr(start, len));
+                    }
+                    start = end + 1;
+                }
+            }
+
+            exitCode = 0;
+            if (loop.items.empty())
+            {
+                pc = insn.target - 1;
+            }
+            else
+            {
+                global_state.let(loop.slot, loop.items[0]);
+                loops.push_back(move(loop));
+            }
+            break;
+        }
+
+        case opcode::foreach_next:
+        {
+            loop_frame& loop = loops.back();
+            if (++loop.index == loop.items.size())
+            {
+                loops.pop_back();
+            }
+            else
+            {
+                global_state.let(loop.slot, loop.items[loop.index]);
+                pc = insn.target - 1;
+            }
+            continue;
+        }
+
+        case opcode::go:
+        case opcode::gosub:
+        {
+            long long number = 0;
+            auto pos = m_labels.end();
+            if (args.size() == 1 && parse_number(args[0], number))
+            {
+                pos = m_labels.find(static_cast<int>(number));
+            }
+
+            if (pos == m_labels.end())
+            {
+                err << "Error: no line " << (args.empty() ? string() : args[0]) << " to " << (insn.op == opcode::go ? "goto" : "gosub") << "\n";
+                global_state.error = true;
+                exitCode = -1;
+                break;
+            }
+
+            if (insn.op == opcode::gosub)
+            {
+                returns.push_back(pc + 1);
+            }
+
+            // Leave any loops the target line isn't in.
+            const label& target = pos->second;
+            if (loops.size() > target.loop_depth)
+            {
+                loops.resize(target.loop_depth);
+            }
+
+            pc = target.pc - 1;
+            break;
+        }
+
+        case opcode::ret:
+            if (returns.empty())
+            {
+                err << "Error: return without gosub\n";
+                global_state.error = true;
+                exitCode = -1;
+                break;
+            }
+
+            pc = returns.back() - 1;
+            returns.pop_back();
+            break;
+
+        case opcode::here_string:
+            args.back().push_back('\n');
+            redirect.in = make_unique<stringstream>(move(args.back()));
+            args.pop_back();
+            continue;
+
+        case opcode::redirect:
+        {
+            const redirect_mode mode = static_cast<redirect_mode>(insn.operand);
+            string path;
+            if (mode != redirect_mode::error_to_output)
+            {
+                path = move(args.back());
+                args.pop_back();
+            }
+
+            // 'exec' hands its output to a program, so it needs the real file.
+            const instruction& command = m_code[insn.target - 1];
+            const bool commandlet = (command.op == opcode::call && command.commandlet != exec_commandlet);
+            if (open_redirection(mode, path, commandlet, redirect, err))
+            {
+                continue;
+            }
+
+            // Skip the command.
+            global_state.error = true;
+            exitCode = -1;
+            global_state.let(global_state::status_slot, to_string(exitCode));
+            stages.clear();
+            pc = insn.target - 1;
+            break;
+        }
+
+        case opcode::call:
+            exitCode = insn.commandlet(redirect.input(in), redirect.output(out), redirect.errors(out, err), global_state, args);
+            break;
+
+        case opcode::pipe:
+            stages.push_back({ (insn.commandlet == nullptr) ? m_strings[insn.operand] : string(), insn.commandlet, move(args) });
+            args.clear();
+            continue;
+
+        case opcode::pipe_run:
+            stages.push_back({ (insn.commandlet == nullptr) ? m_strings[insn.operand] : string(), insn.commandlet, move(args) });
+            exitCode = run_pipeline(stages, redirect.input(in), redirect.output(out), redirect.errors(out, err), global_state);
+            stages.clear();
+
+            // Save the return value as $?
+            global_state.let(global_state::status_slot, to_string(exitCode));
+            break;
+
+        case opcode::spawn:
+            stages.push_back({ m_strings[insn.operand], nullptr, move(args) });
+            exitCode = start_job(stages, redirect.input(in), redirect.output(out), redirect.errors(out, err), global_state) ? 0 : -1;
+            stages.clear();
+            global_state.let(global_state::status_slot, to_string(exitCode));
+            break;
+
+        case opcode::assign:
+            global_state.let(insn.operand, move(args.back()));
+            exitCode = 0;
+            break;
+
+        case opcode::assign_number:
+        {
+            const calculation& calc = m_calculations[insn.operand];
+            long long value = calc.expression.evaluate(global_state, err);
+            exitCode = -1;
+            if (!global_state.error)
+            {
+                global_state.let_number(calc.slot, value);
+                exitCode = 0;
+            }
+            break;
+        }
+
+        case opcode::exec:
+        {
+            const string& program = m_strings[insn.operand];
+            ostream& commandErr = redirect.errors(out, err);
+            string path;
+            bool ok = false;
+            if (global_state.find_command(program, path))
+            {
+                Process p(program, args, path);
+                if (exec_last && pc + 1 == n)
+                {
+                    // It's the very last thing the shell will do, so there's no need to wait for it.
+                    p.Exec(redirect.input(in), redirect.output(out), commandErr);
+                }
+                ok = p.Run(redirect.input(in), redirect.output(out), commandErr, &exitCode);
+            }
+            else
+            {
+                commandErr << "Error: command not found: " << program << endl;
+            }
+
+            if (!ok)
+            {
+                commandErr << "process failed!\n";
+                exitCode = -1;
+                global_state.error = true;
+            }
+
+            // Save the return value as $?
+            global_state.let(global_state::status_slot, to_string(exitCode));
+            break;
+        }
+        }
+
+        // A command was run.
+        args.clear();
+        redirect = redirections();
+
+        if (global_state.exit)
+        {
+            if (!global_state.error)
+            {
+                // Exit here.
+                break;
+            }
+            else
+            {
+                global_state.exit = false;
+            }
+        }
+
+        if (global_state.error)
+        {
+            if (!global_state.interactive)
+            {
+                // Error in a non-interactive (batch) script.
+                // Terminate now.
+                break;
+            }
+
+            // Error in an interactive session.
+            // Do not terminate; just clear the error and continue to read input.
+            global_state.error = false;
+        }
+    }
+
+    return exitCode;
+}